@@ -1,150 +1,7991 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #define FILENAME_SIZE 1024
 #define MAX_LINE 2048
+#define PACKED_MAX_DIGITS 15
+#define NUMBER_TEXT_SIZE (PACKED_MAX_DIGITS + 2)
+#define NUMBER_INPUT_SIZE 32
+#define LOAD_BATCH 64
+#ifndef DEFAULT_COUNTRY_CODE
+#define DEFAULT_COUNTRY_CODE 1
+#endif
+#define ARENA_PAGE_SIZE 4096
+#define MAX_NAME_LENGTH 255
+#define NAME_PREFIX_SIZE 4
+#define TABLE_PAGE_ROWS 4096
+#define SNAPSHOT_MAGIC "TELDIR\0\0"
+#define SNAPSHOT_VERSION 2
+#define MPH_BUCKET_SIZE 4
+#define MPH_MAX_DISPLACEMENT (1u << 20)
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_HASHES 7
+#define LSM_PREFIX "telephone_directory.lsm"
+#define LSM_MAX_HEIGHT 12
+#define LSM_MAX_RUNS 32
+#define LSM_MAX_LEVELS 6
+#define LSM_BLOCK_SIZE 4096
+#define LSM_RECORD_HEADER 18
+#define LSM_RUN_MAGIC 0x3255524cu
+#define LSM_MEMTABLE_LIMIT 4096
+#define LSM_L0_LIMIT 4
+#define LSM_LEVEL_BASE 16384
+#define LSM_LEVEL_RATIO 10
+#define BLOCK_CACHE_SHARDS 16
+#define BLOCK_CACHE_BUCKETS 1024
+#define BLOCK_CACHE_DEFAULT_BYTES (8u << 20)
+#define LOOKUP_CACHE_SLOTS 1024
+#define LOOKUP_MAX_ROWS 4
+#define LOOKUP_NAME_SIZE 32
+#define LOOKUP_BY_NAME 0
+#define LOOKUP_BY_NUMBER 1
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+#define SKETCH_RESET_SAMPLES (10 * LOOKUP_CACHE_SLOTS)
+#define EPOCH_MAX_THREADS 128
+#define SHARD_MAX 64
+#define SHARD_COUNT_FILENAME "telephone_directory.shards"
+#define IO_RING_ENTRIES 32
+#define IO_BATCH_BLOCKS 8
+#define LSM_LOG_BATCH 2
+#define TXN_MAX_OPS 16
+#define TXN_MAX_ENTRIES (2 * TXN_MAX_OPS)
+#define TXN_CONFLICT -2
+#define SORT_DEFAULT_MEMORY (64u << 20)
+#define SORT_MIN_BUFFER (64u << 10)
+#define SORT_MAX_THREADS 8
+#define SORT_MAX_FANIN 64
+#define SORT_READ_BUFFER (64u << 10)
+#define MERGE_NEWEST 0
+#define MERGE_LEFT 1
+#define MERGE_BOTH 2
+#define DIFF_PARTITIONS 64
+#define DIFF_NONE 0
+#define DIFF_ADDED 1
+#define DIFF_REMOVED 2
+#define DIFF_CHANGED 3
+#define DEDUP_MAX_BLOCK 32
+#define DEDUP_WINDOW 8
+#define DEDUP_THRESHOLD 0.85
+#define DEDUP_SUFFIX_DIGITS 7
+#define RADIX_NAME_BYTES 20
+#define RADIX_KEY_SIZE (RADIX_NAME_BYTES + 8)
+#define RADIX_PARALLEL_MIN 65536
+#define CURSOR_BY_ROW 2
+#define CURSOR_BATCH 64
+#define CURSOR_TOKEN_BYTES (22 + MAX_NAME_LENGTH)
+#define CURSOR_TOKEN_SIZE (2 * CURSOR_TOKEN_BYTES + 1)
+#define CHANGE_LOG_FILENAME "telephone_directory.changes"
+#define CHANGE_RING_SIZE 1024
+#define CHANGE_BATCH 64
+#define CHANGE_POLL_MS 100
+#define CHANGE_CLEAR 0
+#define CHANGE_INSERT 1
+#define CHANGE_UPDATE 2
+#define CHANGE_DELETE 3
+#define CHANGE_CONTINUED 1
+#define FOLLOWER_FILENAME "telephone_directory.replica.txt"
 int num = 0;
 
 struct telephone
 {
-    char name[20];
-    char number[11];
+    char name[MAX_NAME_LENGTH + 1];
+    char number[NUMBER_TEXT_SIZE];
 };
 
-// Function to insert spaces in the file
-void space(int len, FILE *file)
+// Numbers are stored as packed BCD in a 64-bit word. Digits sit in the
+// high nibbles (first digit on top) and the digit count in the low nibble,
+// so leading zeros survive and comparing two packed numbers as integers
+// orders them like the text.
+
+// Function to pack a digit string into a 64-bit BCD word
+int packNumber(const char *text, uint64_t *packed)
+{
+    uint64_t value = 0;
+    int len = strlen(text);
+    
+    if (len == 0 || len > PACKED_MAX_DIGITS)
+    {
+        return -1;
+    }
+    
+    for (int i = 0; i < len; i++)
+    {
+        unsigned digit = (unsigned char)text[i] - '0';
+        if (digit > 9)
+        {
+            return -1;
+        }
+        value |= (uint64_t)digit << (60 - 4 * i);
+    }
+    
+    *packed = value | (uint64_t)len;
+    return 0;
+}
+
+// Function to unpack a 64-bit BCD word back into a digit string
+void unpackNumber(uint64_t packed, char *text)
+{
+    int len = packed & 0xF;
+    
+    for (int i = 0; i < len; i++)
+    {
+        text[i] = '0' + ((packed >> (60 - 4 * i)) & 0xF);
+    }
+    text[len] = '\0';
+}
+
+// Function to write a packed number in its canonical text form: a + and
+// the E.164 digits, so it is never read back as a national number
+void formatNumber(uint64_t packed, char *text)
+{
+    text[0] = '+';
+    unpackNumber(packed, text + 1);
+}
+
+// Function to format many packed numbers at once, like formatNumber. Every
+// field is filled to its full width without early exits so the compiler
+// can vectorize the inner loop.
+void formatNumbers(const uint64_t *packed, char (*texts)[NUMBER_TEXT_SIZE], int count)
+{
+    for (int n = 0; n < count; n++)
+    {
+        unsigned len = packed[n] & 0xF;
+        
+        texts[n][0] = '+';
+        for (int i = 0; i < PACKED_MAX_DIGITS; i++)
+        {
+            char digit = '0' + ((packed[n] >> (60 - 4 * i)) & 0xF);
+            texts[n][i + 1] = (unsigned)i < len ? digit : '\0';
+        }
+        texts[n][PACKED_MAX_DIGITS + 1] = '\0';
+    }
+}
+
+// Function to pack many digit strings at once; returns how many were
+// invalid, and invalid ones get the packed value 0, which no valid number
+// has. The inner loop runs over the whole fixed-width field without early
+// exits so the compiler can vectorize it.
+int packNumbers(const char (*texts)[NUMBER_INPUT_SIZE], uint64_t *packed, int count)
+{
+    int invalid = 0;
+    
+    for (int n = 0; n < count; n++)
+    {
+        uint64_t value = 0;
+        unsigned len = 0;
+        unsigned bad = 0;
+        unsigned ended = 0;
+        
+        for (int i = 0; i < PACKED_MAX_DIGITS; i++)
+        {
+            unsigned c = (unsigned char)texts[n][i];
+            unsigned digit = c - '0';
+            ended |= (c == '\0');
+            bad |= !ended & (digit > 9);
+            len += !ended;
+            value |= (uint64_t)(digit & -(uint64_t)!ended & 0xF) << (60 - 4 * i);
+        }
+        
+        bad |= (len == 0) | (texts[n][PACKED_MAX_DIGITS] != '\0' && !ended);
+        invalid += bad;
+        packed[n] = bad ? 0 : (value | len);
+    }
+    
+    return invalid;
+}
+
+// E.164 normalization. A number may be written with spaces, dashes, dots,
+// slashes and parentheses, and with a leading + or 00 when it is
+// international; otherwise it is read as a national number of
+// DEFAULT_COUNTRY_CODE (set with -DDEFAULT_COUNTRY_CODE=44 and so on),
+// without its trunk prefix. The canonical form is the country code
+// followed by the national number, at most 15 digits. It is packed
+// without the +, and always shown and written with it, so exported files
+// read back unchanged. A bare number too long or too short for the
+// default country is still tried as an international one.
+//
+// The table is expanded at compile time into arrays indexed by country
+// code: the national number lengths (minimum and maximum, a nibble each)
+// and the trunk prefix digit plus one. Country codes are prefix-free, so
+// at most one of the 1, 2 and 3 digit prefixes of a number is a country.
+#define COUNTRY_TABLE(X) \
+    X(1, 10, 10, 1) X(7, 10, 10, 8) X(20, 9, 10, 0) X(27, 9, 9, 0) X(30, 10, 10, -1) X(31, 9, 9, 0) \
+    X(32, 8, 9, 0) X(33, 9, 9, 0) X(34, 9, 9, -1) X(39, 6, 11, -1) X(41, 9, 9, 0) X(43, 4, 13, 0) \
+    X(44, 9, 10, 0) X(45, 8, 8, -1) X(46, 7, 9, 0) X(47, 8, 8, -1) X(48, 9, 9, -1) X(49, 6, 13, 0) \
+    X(52, 10, 10, -1) X(54, 10, 10, 0) X(55, 10, 11, 0) X(61, 9, 9, 0) X(62, 8, 12, 0) X(63, 10, 10, 0) \
+    X(64, 8, 10, 0) X(65, 8, 8, -1) X(66, 8, 9, 0) X(81, 9, 10, 0) X(82, 8, 10, 0) X(84, 9, 10, 0) \
+    X(86, 10, 11, 0) X(90, 10, 10, 0) X(91, 10, 10, 0) X(92, 9, 10, 0) X(234, 8, 10, 0) X(351, 9, 9, -1) \
+    X(353, 7, 9, 0) X(358, 5, 12, 0) X(380, 9, 9, 0) X(852, 8, 8, -1) X(886, 8, 9, 0) X(971, 8, 9, 0) \
+    X(972, 8, 9, 0)
+#define COUNTRY_LENGTHS(code, min, max, trunk) [code] = (min) << 4 | (max),
+#define COUNTRY_TRUNK(code, min, max, trunk) [code] = (trunk) + 1,
+#define NUMBER_STRING(value) #value
+#define NUMBER_TEXT(value) NUMBER_STRING(value)
+
+const unsigned char country_lengths[1000] = {COUNTRY_TABLE(COUNTRY_LENGTHS)};
+const unsigned char country_trunks[1000] = {COUNTRY_TABLE(COUNTRY_TRUNK)};
+
+// Function to check that a country code exists and takes national numbers
+// of the given length
+unsigned countryFits(int code, int length)
+{
+    unsigned lengths = country_lengths[code];
+    return (lengths != 0) & (length >= (int)(lengths >> 4)) & (length <= (int)(lengths & 0xF));
+}
+
+// Function to write the canonical E.164 digits of a phone number into a
+// buffer of NUMBER_INPUT_SIZE bytes; returns -1 if it is not a valid number
+int canonicalNumber(const char *text, char *canonical)
+{
+    char digits[NUMBER_INPUT_SIZE + 3];
+    int len = strlen(text);
+    int count = 0;
+    unsigned bad = 0;
+    unsigned plus = 0;
+    
+    if (len >= NUMBER_INPUT_SIZE)
+    {
+        return -1;
+    }
+    
+    // Keep the digits; a + counts only before the first one
+    for (int i = 0; i < len; i++)
+    {
+        unsigned c = (unsigned char)text[i];
+        unsigned is_digit = c - '0' <= 9;
+        unsigned is_plus = (c == '+') & (count == 0);
+        unsigned is_separator = (c == ' ') | (c == '-') | (c == '.') | (c == '/') | (c == '(') | (c == ')');
+        digits[count] = c;
+        count += is_digit;
+        plus |= is_plus;
+        bad |= !(is_digit | is_plus | is_separator);
+    }
+    memset(digits + count, '0', 3);
+    
+    // 00 is the international call prefix
+    unsigned zeros = !plus & (count > 2) & (digits[0] == '0') & (digits[1] == '0');
+    const char *international = digits + 2 * zeros;
+    int international_count = count - 2 * zeros;
+    int c1 = international[0] - '0';
+    int c2 = c1 * 10 + international[1] - '0';
+    int c3 = c2 * 10 + international[2] - '0';
+    int code_length = countryFits(c1, international_count - 1) | countryFits(c2, international_count - 2) << 1 |
+                      (countryFits(c3, international_count - 3) * 3);
+    
+    int trunk = country_trunks[DEFAULT_COUNTRY_CODE] - 1;
+    unsigned strip = (trunk >= 0) & (digits[0] - '0' == trunk) & countryFits(DEFAULT_COUNTRY_CODE, count - 1);
+    unsigned national = ((plus | zeros) == 0) & countryFits(DEFAULT_COUNTRY_CODE, count - strip);
+    
+    if (bad || (!national && code_length == 0))
+    {
+        return -1;
+    }
+    if (national)
+    {
+        snprintf(canonical, NUMBER_INPUT_SIZE, "%s%.*s", NUMBER_TEXT(DEFAULT_COUNTRY_CODE), count - strip,
+                 digits + strip);
+    }
+    else
+    {
+        memcpy(canonical, international, international_count);
+        canonical[international_count] = '\0';
+    }
+    return 0;
+}
+
+// Function to normalize a phone number to its canonical E.164 digits and
+// pack them; returns -1 if it is not a valid number
+int normalizeNumber(const char *text, uint64_t *packed)
+{
+    char canonical[NUMBER_INPUT_SIZE];
+    
+    if (canonicalNumber(text, canonical) != 0)
+    {
+        return -1;
+    }
+    return packNumber(canonical, packed);
+}
+
+// Function to normalize a batch of numbers while bulk loading. Each text
+// is first rewritten to its canonical digits in the scratch buffer, then
+// the whole batch is packed at once; invalid numbers get the packed value
+// 0. Returns the count of invalid numbers.
+int normalizeNumbers(const char (*texts)[NUMBER_INPUT_SIZE], char (*scratch)[NUMBER_INPUT_SIZE],
+                     uint64_t *packed, int count)
+{
+    for (int n = 0; n < count; n++)
+    {
+        if (canonicalNumber(texts[n], scratch[n]) != 0)
+        {
+            scratch[n][0] = '\0';
+        }
+    }
+    return packNumbers((const char (*)[NUMBER_INPUT_SIZE])scratch, packed, count);
+}
+
+// Append-only string heap for names. Names are stored back to back in
+// fixed-size pages and never straddle a page, so an offset is simply
+// page * ARENA_PAGE_SIZE + position and stays valid for the arena's life.
+struct name_arena
+{
+    char **pages;
+    int page_count;
+    int page_capacity;
+    uint32_t used;
+};
+
+// Function to get the inline prefix of a name: its first NAME_PREFIX_SIZE
+// bytes, big-endian and zero-padded, so comparing two prefixes as integers
+// orders them like memcmp on the names
+uint32_t namePrefix(const char *name, int len)
+{
+    uint32_t prefix = 0;
+    
+    for (int i = 0; i < NAME_PREFIX_SIZE; i++)
+    {
+        prefix = prefix << 8 | (i < len ? (unsigned char)name[i] : 0);
+    }
+    return prefix;
+}
+
+// Function to copy a name into the arena and return its offset
+int arenaAppend(struct name_arena *arena, const char *name, int len, uint32_t *offset)
+{
+    if (len > MAX_NAME_LENGTH)
+    {
+        return -1;
+    }
+    
+    uint32_t position = arena->used - (uint32_t)(arena->page_count - 1) * ARENA_PAGE_SIZE;
+    if (arena->page_count == 0 || position + len > ARENA_PAGE_SIZE)
+    {
+        if (arena->page_count == arena->page_capacity)
+        {
+            int capacity = arena->page_capacity ? arena->page_capacity * 2 : 8;
+            char **pages = realloc(arena->pages, capacity * sizeof(char *));
+            if (pages == NULL)
+            {
+                return -1;
+            }
+            arena->pages = pages;
+            arena->page_capacity = capacity;
+        }
+        
+        char *page = malloc(ARENA_PAGE_SIZE);
+        if (page == NULL)
+        {
+            return -1;
+        }
+        arena->pages[arena->page_count] = page;
+        arena->used = (uint32_t)arena->page_count * ARENA_PAGE_SIZE;
+        arena->page_count++;
+        position = 0;
+    }
+    
+    memcpy(arena->pages[arena->page_count - 1] + position, name, len);
+    *offset = arena->used;
+    arena->used += len;
+    return 0;
+}
+
+// Function to get a pointer to a name stored in the arena
+const char *arenaGet(const struct name_arena *arena, uint32_t offset)
+{
+    return arena->pages[offset / ARENA_PAGE_SIZE] + offset % ARENA_PAGE_SIZE;
+}
+
+// Function to release every page of the arena
+void arenaFree(struct name_arena *arena)
+{
+    for (int i = 0; i < arena->page_count; i++)
+    {
+        free(arena->pages[i]);
+    }
+    free(arena->pages);
+    memset(arena, 0, sizeof(*arena));
+}
+
+// In-memory directory kept as columns: names (arena offset and length),
+// packed numbers and a liveness bitmap. Rows are grouped into pages of
+// TABLE_PAGE_ROWS and each page holds its own slice of every column, so
+// scans still walk just the columns they need. Deleted rows only clear
+// their bit, so row indexes stay stable.
+//
+// Pages are reference counted. A snapshot is a directory_table that shares
+// the live table's pages; a writer copies a page before changing it while a
+// snapshot still holds it, so readers of the snapshot never see a change.
+// The generation counts changes, so data derived from the table can tell
+// when it has gone stale.
+struct table_page
+{
+    int refs;
+    uint32_t name_offsets[TABLE_PAGE_ROWS];
+    uint8_t name_lengths[TABLE_PAGE_ROWS];
+    uint32_t name_prefixes[TABLE_PAGE_ROWS];
+    uint64_t numbers[TABLE_PAGE_ROWS];
+    uint32_t versions[TABLE_PAGE_ROWS];
+    uint64_t live[TABLE_PAGE_ROWS / 64];
+};
+
+struct directory_table
+{
+    int count;
+    int live_count;
+    int page_count;
+    int page_capacity;
+    int is_snapshot;
+    uint64_t generation;
+    struct table_page **pages;
+    struct name_arena names;
+};
+
+struct directory_table directory;
+
+// Function to check whether a row of the table is live
+int tableIsLive(const struct directory_table *table, int row)
+{
+    const struct table_page *page = table->pages[row / TABLE_PAGE_ROWS];
+    int slot = row % TABLE_PAGE_ROWS;
+    return (page->live[slot / 64] >> (slot % 64)) & 1;
+}
+
+// Function to get one 64-row word of the liveness bitmap
+uint64_t tableLiveWord(const struct directory_table *table, int word)
+{
+    return table->pages[word / (TABLE_PAGE_ROWS / 64)]->live[word % (TABLE_PAGE_ROWS / 64)];
+}
+
+// Function to get the packed number of a row
+uint64_t tableNumber(const struct directory_table *table, int row)
+{
+    return table->pages[row / TABLE_PAGE_ROWS]->numbers[row % TABLE_PAGE_ROWS];
+}
+
+// Function to get the version of a row; every change to a row bumps it
+uint32_t tableVersion(const struct directory_table *table, int row)
+{
+    return table->pages[row / TABLE_PAGE_ROWS]->versions[row % TABLE_PAGE_ROWS];
+}
+
+// Function to get the length of a row's name
+int tableNameLength(const struct directory_table *table, int row)
+{
+    return table->pages[row / TABLE_PAGE_ROWS]->name_lengths[row % TABLE_PAGE_ROWS];
+}
+
+// Function to get a pointer to a row's name (not terminated)
+const char *tableNamePointer(const struct directory_table *table, int row)
+{
+    return arenaGet(&table->names, table->pages[row / TABLE_PAGE_ROWS]->name_offsets[row % TABLE_PAGE_ROWS]);
+}
+
+// Function to get a row's inline name prefix (see namePrefix)
+uint32_t tableNamePrefix(const struct directory_table *table, int row)
+{
+    return table->pages[row / TABLE_PAGE_ROWS]->name_prefixes[row % TABLE_PAGE_ROWS];
+}
+
+// Function to compare a row's name with a name and its prefix, like
+// memcmp on the names then their lengths. Most names differ within the
+// prefix, so the arena is only read when the prefixes are equal.
+int tableCompareName(const struct directory_table *table, int row, const char *name, int len, uint32_t prefix)
+{
+    uint32_t own = tableNamePrefix(table, row);
+    
+    if (own != prefix)
+    {
+        return own < prefix ? -1 : 1;
+    }
+    
+    int own_len = tableNameLength(table, row);
+    int common = own_len < len ? own_len : len;
+    int skip = common < NAME_PREFIX_SIZE ? common : NAME_PREFIX_SIZE;
+    int result = memcmp(tableNamePointer(table, row) + skip, name + skip, common - skip);
+    return result ? result : own_len - len;
+}
+
+// Function to drop one reference to a page, freeing it with the last one
+void tablePageRelease(struct table_page *page)
+{
+    if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(page);
+    }
+}
+
+// Function to get the page holding a row, copying it first if shared
+struct table_page *tableWritablePage(struct directory_table *table, int row)
+{
+    struct table_page **slot = &table->pages[row / TABLE_PAGE_ROWS];
+    
+    if (__atomic_load_n(&(*slot)->refs, __ATOMIC_ACQUIRE) > 1)
+    {
+        struct table_page *copy = malloc(sizeof(struct table_page));
+        if (copy == NULL)
+        {
+            return NULL;
+        }
+        // Copy the columns only; refs may be changing under a reader
+        memcpy(copy->name_offsets, (*slot)->name_offsets, sizeof(copy->name_offsets));
+        memcpy(copy->name_lengths, (*slot)->name_lengths, sizeof(copy->name_lengths));
+        memcpy(copy->name_prefixes, (*slot)->name_prefixes, sizeof(copy->name_prefixes));
+        memcpy(copy->numbers, (*slot)->numbers, sizeof(copy->numbers));
+        memcpy(copy->versions, (*slot)->versions, sizeof(copy->versions));
+        memcpy(copy->live, (*slot)->live, sizeof(copy->live));
+        copy->refs = 1;
+        tablePageRelease(*slot);
+        *slot = copy;
+    }
+    return *slot;
+}
+
+// Function to make room for one more row, adding a page when needed
+int tableReserve(struct directory_table *table)
+{
+    if (table->count < table->page_count * TABLE_PAGE_ROWS)
+    {
+        return 0;
+    }
+    
+    if (table->page_count == table->page_capacity)
+    {
+        int capacity = table->page_capacity ? table->page_capacity * 2 : 8;
+        struct table_page **pages = realloc(table->pages, capacity * sizeof(struct table_page *));
+        if (pages == NULL)
+        {
+            return -1;
+        }
+        table->pages = pages;
+        table->page_capacity = capacity;
+    }
+    
+    struct table_page *page = calloc(1, sizeof(struct table_page));
+    if (page == NULL)
+    {
+        return -1;
+    }
+    page->refs = 1;
+    table->pages[table->page_count++] = page;
+    return 0;
+}
+
+// Function to store a name and number in a row
+int tableSetRow(struct directory_table *table, int row, const char *name, uint64_t number)
+{
+    int len = strlen(name);
+    uint32_t offset;
+    
+    if (arenaAppend(&table->names, name, len, &offset) != 0)
+    {
+        return -1;
+    }
+    
+    struct table_page *page = tableWritablePage(table, row);
+    if (page == NULL)
+    {
+        return -1;
+    }
+    int slot = row % TABLE_PAGE_ROWS;
+    page->name_offsets[slot] = offset;
+    page->name_lengths[slot] = len;
+    page->name_prefixes[slot] = namePrefix(name, len);
+    page->numbers[slot] = number;
+    page->versions[slot]++;
+    table->generation++;
+    return 0;
+}
+
+// Function to add a row to the table; returns the row index or -1
+int tableAppend(struct directory_table *table, const char *name, uint64_t number)
+{
+    int row = table->count;
+    
+    if (tableReserve(table) != 0 || tableSetRow(table, row, name, number) != 0)
+    {
+        return -1;
+    }
+    
+    struct table_page *page = table->pages[row / TABLE_PAGE_ROWS];
+    int slot = row % TABLE_PAGE_ROWS;
+    page->live[slot / 64] |= 1ULL << (slot % 64);
+    table->live_count++;
+    table->count++;
+    return row;
+}
+
+// Function to replace the name and number of a live row
+int tableUpdate(struct directory_table *table, int row, const char *name, uint64_t number)
+{
+    return tableSetRow(table, row, name, number);
+}
+
+// Function to mark a row of the table as deleted
+void tableDelete(struct directory_table *table, int row)
+{
+    if (tableIsLive(table, row))
+    {
+        struct table_page *page = tableWritablePage(table, row);
+        if (page == NULL)
+        {
+            return;
+        }
+        int slot = row % TABLE_PAGE_ROWS;
+        page->live[slot / 64] &= ~(1ULL << (slot % 64));
+        page->versions[slot]++;
+        table->live_count--;
+        table->generation++;
+    }
+}
+
+// Function to set the version of a row, used when loading stored rows
+int tableSetVersion(struct directory_table *table, int row, uint32_t version)
+{
+    struct table_page *page = tableWritablePage(table, row);
+    if (page == NULL)
+    {
+        return -1;
+    }
+    page->versions[row % TABLE_PAGE_ROWS] = version;
+    return 0;
+}
+
+// Function to pin the current version of a table. The snapshot shares
+// pages with the table and must be released with tableFree.
+int tableSnapshot(const struct directory_table *table, struct directory_table *snapshot)
+{
+    *snapshot = *table;
+    snapshot->is_snapshot = 1;
+    snapshot->page_capacity = table->page_count;
+    snapshot->pages = malloc((table->page_count + 1) * sizeof(struct table_page *));
+    snapshot->names.pages = malloc((table->names.page_count + 1) * sizeof(char *));
+    if (snapshot->pages == NULL || snapshot->names.pages == NULL)
+    {
+        free(snapshot->pages);
+        free(snapshot->names.pages);
+        return -1;
+    }
+    
+    // The arena is append-only, so copying its page list is enough to keep
+    // every name the snapshot can see stable
+    memcpy(snapshot->names.pages, table->names.pages, table->names.page_count * sizeof(char *));
+    snapshot->names.page_capacity = table->names.page_count;
+    for (int i = 0; i < table->page_count; i++)
+    {
+        snapshot->pages[i] = table->pages[i];
+        __atomic_add_fetch(&table->pages[i]->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    return 0;
+}
+
+// Function to find the row holding the n-th live entry (1-based)
+int tableRowForEntry(const struct directory_table *table, int entry)
+{
+    if (entry < 1 || entry > table->live_count)
+    {
+        return -1;
+    }
+    
+    for (int word = 0; word * 64 < table->count; word++)
+    {
+        uint64_t mask = tableLiveWord(table, word);
+        int bits = __builtin_popcountll(mask);
+        if (entry > bits)
+        {
+            entry -= bits;
+            continue;
+        }
+    
+        while (--entry > 0)
+        {
+            mask &= mask - 1;
+        }
+        return word * 64 + __builtin_ctzll(mask);
+    }
+    
+    return -1;
+}
+
+// Function to get the 1-based entry number of a live row
+int tableEntryForRow(const struct directory_table *table, int row)
+{
+    int entry = 1;
+    
+    for (int word = 0; word < row / 64; word++)
+    {
+        entry += __builtin_popcountll(tableLiveWord(table, word));
+    }
+    entry += __builtin_popcountll(tableLiveWord(table, row / 64) & ((1ULL << (row % 64)) - 1));
+    return entry;
+}
+
+// Function to copy the name of a row into a buffer
+void tableName(const struct directory_table *table, int row, char *name)
+{
+    int len = tableNameLength(table, row);
+    
+    memcpy(name, tableNamePointer(table, row), len);
+    name[len] = '\0';
+}
+
+// Function to print one row of the table
+void tablePrintRow(const struct directory_table *table, int row)
+{
+    char name[MAX_NAME_LENGTH + 1];
+    char number[NUMBER_TEXT_SIZE];
+    
+    tableName(table, row, name);
+    formatNumber(tableNumber(table, row), number);
+    printf("Entry %d: %-20s %s\n", tableEntryForRow(table, row), name, number);
+}
+
+// Function to scan the name column for an exact name and print the matches
+// with print. The first max_rows matching rows are stored in rows; returns
+// the match count.
+int tableFindName(const struct directory_table *table, const char *name, int *rows, int max_rows,
+                  void (*print)(const struct directory_table *, int))
+{
+    int len = strlen(name);
+    uint32_t prefix = namePrefix(name, len);
+    int found = 0;
+    
+    for (int word = 0; word * 64 < table->count; word++)
+    {
+        uint64_t mask = tableLiveWord(table, word);
+        while (mask)
+        {
+            int row = word * 64 + __builtin_ctzll(mask);
+            mask &= mask - 1;
+    
+            if (tableNamePrefix(table, row) == prefix && tableCompareName(table, row, name, len, prefix) == 0)
+            {
+                print(table, row);
+                if (found < max_rows)
+                {
+                    rows[found] = row;
+                }
+                found++;
+            }
+        }
+    }
+    
+    return found;
+}
+
+// Function to scan the number column for a packed number and print the
+// matches with print, storing the first max_rows of them; returns the match
+// count
+int tableFindNumber(const struct directory_table *table, uint64_t number, int *rows, int max_rows,
+                    void (*print)(const struct directory_table *, int))
+{
+    int found = 0;
+    
+    for (int p = 0; p < table->page_count; p++)
+    {
+        const struct table_page *page = table->pages[p];
+        int first = p * TABLE_PAGE_ROWS;
+        int rows_in_page = table->count - first < TABLE_PAGE_ROWS ? table->count - first : TABLE_PAGE_ROWS;
+    
+        for (int slot = 0; slot < rows_in_page; slot++)
+        {
+            if (page->numbers[slot] == number && tableIsLive(table, first + slot))
+            {
+                print(table, first + slot);
+                if (found < max_rows)
+                {
+                    rows[found] = first + slot;
+                }
+                found++;
+            }
+        }
+    }
+    
+    return found;
+}
+
+// Function to write one entry with an already formatted number in the
+// text file format
+void exportText(FILE *file, const char *name, int len, const char *number)
+{
+    fwrite(name, 1, len, file);
+    fprintf(file, "%*s%s\n", len < 20 ? 20 - len : 1, "", number);
+}
+
+// Function to write one entry in the text file format
+void exportLine(FILE *file, const char *name, int len, uint64_t packed)
+{
+    char number[NUMBER_TEXT_SIZE];
+    
+    formatNumber(packed, number);
+    exportText(file, name, len, number);
+}
+
+// Function to export the live rows of the table in the text file format,
+// formatting the numbers of each 64-row word in one batch
+void tableExport(const struct directory_table *table, FILE *file)
+{
+    int rows[64];
+    uint64_t numbers[64];
+    char texts[64][NUMBER_TEXT_SIZE];
+    
+    fprintf(file, "NAME                    NUMBER\n");
+    
+    for (int word = 0; word * 64 < table->count; word++)
+    {
+        uint64_t mask = tableLiveWord(table, word);
+        int count = 0;
+        while (mask)
+        {
+            rows[count] = word * 64 + __builtin_ctzll(mask);
+            numbers[count] = tableNumber(table, rows[count]);
+            count++;
+            mask &= mask - 1;
+        }
+    
+        formatNumbers(numbers, texts, count);
+        for (int i = 0; i < count; i++)
+        {
+            exportText(file, tableNamePointer(table, rows[i]), tableNameLength(table, rows[i]), texts[i]);
+        }
+    }
+}
+
+// Function to split a directory file line into its name and number
+int parseLine(char *line, char *name, char *number)
+{
+    int len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    
+    char *space = strrchr(line, ' ');
+    if (space == NULL || space[1] == '\0' || strlen(space + 1) >= NUMBER_INPUT_SIZE)
+    {
+        return -1;
+    }
+    strcpy(number, space + 1);
+    
+    int name_len = space - line;
+    while (name_len > 0 && line[name_len - 1] == ' ')
+    {
+        name_len--;
+    }
+    if (name_len == 0 || name_len > MAX_NAME_LENGTH)
+    {
+        return -1;
+    }
+    memcpy(name, line, name_len);
+    name[name_len] = '\0';
+    return 0;
+}
+
+// Function to load a directory file into the table; returns rows loaded
+// or -1. Lines are parsed a batch at a time and the batch's numbers are
+// normalized together.
+int tableLoad(struct directory_table *table, FILE *file)
+{
+    char line[MAX_LINE];
+    char names[LOAD_BATCH][MAX_NAME_LENGTH + 1];
+    char numbers[LOAD_BATCH][NUMBER_INPUT_SIZE];
+    char canonical[LOAD_BATCH][NUMBER_INPUT_SIZE];
+    uint64_t packed[LOAD_BATCH];
+    int loaded = 0;
+    int more = 1;
+    
+    // Skip the header line
+    if (fgets(line, MAX_LINE, file) == NULL)
+    {
+        return 0;
+    }
+    
+    while (more)
+    {
+        int count = 0;
+        while (count < LOAD_BATCH && (more = fgets(line, MAX_LINE, file) != NULL))
+        {
+            if (parseLine(line, names[count], numbers[count]) != 0)
+            {
+                printf("Skipping malformed line: %s\n", line);
+                continue;
+            }
+            count++;
+        }
+    
+        normalizeNumbers((const char (*)[NUMBER_INPUT_SIZE])numbers, canonical, packed, count);
+        for (int i = 0; i < count; i++)
+        {
+            if (packed[i] == 0)
+            {
+                printf("Skipping invalid phone number: %s %s\n", names[i], numbers[i]);
+                continue;
+            }
+            if (tableAppend(table, names[i], packed[i]) < 0)
+            {
+                return -1;
+            }
+            loaded++;
+        }
+    }
+    
+    return loaded;
+}
+
+// Function to release a table or a snapshot; a snapshot only gives back
+// its page references, since the arena belongs to the live table
+void tableFree(struct directory_table *table)
+{
+    for (int i = 0; i < table->page_count; i++)
+    {
+        tablePageRelease(table->pages[i]);
+    }
+    free(table->pages);
+    if (table->is_snapshot)
+    {
+        free(table->names.pages);
+    }
+    else
+    {
+        arenaFree(&table->names);
+    }
+    memset(table, 0, sizeof(*table));
+}
+
+// Crash-safe replacement of a whole file. The new contents go to a unique
+// temporary file next to the target, which is flushed to disk and then
+// renamed over the target; syncing the directory afterwards makes the
+// rename itself durable. A crash leaves either the old file or the new one.
+struct atomic_file
+{
+    FILE *file;
+    char target[FILENAME_SIZE];
+    char temp[FILENAME_SIZE];
+};
+
+// Function to start replacing a file; returns the stream to write or NULL
+FILE *atomicOpen(struct atomic_file *replace, const char *target, const char *mode)
+{
+    size_t len = strlen(target);
+    
+    if (len + 8 > sizeof(replace->temp))
+    {
+        return NULL;
+    }
+    memcpy(replace->target, target, len + 1);
+    memcpy(replace->temp, target, len);
+    memcpy(replace->temp + len, ".XXXXXX", 8);
+    
+    int fd = mkstemp(replace->temp);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    fchmod(fd, 0644);
+    replace->file = fdopen(fd, mode);
+    if (replace->file == NULL)
+    {
+        close(fd);
+        unlink(replace->temp);
+    }
+    return replace->file;
+}
+
+// Function to abandon a replacement, leaving the target untouched
+void atomicAbort(struct atomic_file *replace)
+{
+    fclose(replace->file);
+    unlink(replace->temp);
+}
+
+// Function to flush a directory entry change to disk
+int syncDirectory(const char *path)
+{
+    char directory_name[FILENAME_SIZE];
+    const char *slash = strrchr(path, '/');
+    
+    if (slash == NULL)
+    {
+        strcpy(directory_name, ".");
+    }
+    else if (slash == path)
+    {
+        strcpy(directory_name, "/");
+    }
+    else
+    {
+        memcpy(directory_name, path, slash - path);
+        directory_name[slash - path] = '\0';
+    }
+    
+    int fd = open(directory_name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+// Function to finish a replacement: sync the data, rename it over the
+// target and sync the directory. Returns 0, or -1 with the target untouched.
+int atomicCommit(struct atomic_file *replace)
+{
+    if (fflush(replace->file) != 0 || ferror(replace->file) || fsync(fileno(replace->file)) != 0)
+    {
+        atomicAbort(replace);
+        return -1;
+    }
+    if (fclose(replace->file) != 0 || rename(replace->temp, replace->target) != 0)
+    {
+        unlink(replace->temp);
+        return -1;
+    }
+    return syncDirectory(replace->target);
+}
+
+// Function to scramble a 64-bit value (splitmix64 finalizer)
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Blocked Bloom filter over packed numbers. Every key sets all of its bits
+// inside one 512-bit block (a cache line), so a query costs one miss.
+struct bloom_filter
+{
+    uint32_t block_count;
+    uint64_t entries;
+    uint64_t (*blocks)[8];
+};
+
+struct bloom_filter bloom;
+uint64_t bloom_negatives = 0;
+
+// Function to size an empty Bloom filter for an expected number of entries
+int bloomInit(struct bloom_filter *filter, uint64_t expected)
+{
+    uint64_t blocks = expected * BLOOM_BITS_PER_ENTRY / 512 + 1;
+    
+    free(filter->blocks);
+    filter->blocks = calloc(blocks, sizeof(*filter->blocks));
+    filter->block_count = filter->blocks ? blocks : 0;
+    filter->entries = 0;
+    return filter->blocks ? 0 : -1;
+}
+
+// Function to add a packed number to a Bloom filter
+void bloomAdd(struct bloom_filter *filter, uint64_t number)
+{
+    uint64_t h = mix64(number);
+    uint64_t *block = filter->blocks[(h >> 32) % filter->block_count];
+    uint32_t h1 = h;
+    uint32_t h2 = (h >> 41) | 1;
+    
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % 512;
+        block[bit / 64] |= 1ULL << (bit % 64);
+    }
+    filter->entries++;
+}
+
+// Function to test whether a packed number may be in a Bloom filter
+int bloomMayContain(const struct bloom_filter *filter, uint64_t number)
+{
+    if (filter->block_count == 0)
+    {
+        return 1;
+    }
+    
+    uint64_t h = mix64(number);
+    const uint64_t *block = filter->blocks[(h >> 32) % filter->block_count];
+    uint32_t h1 = h;
+    uint32_t h2 = (h >> 41) | 1;
+    uint64_t missing = 0;
+    
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % 512;
+        missing |= ~block[bit / 64] & (1ULL << (bit % 64));
+    }
+    return missing == 0;
+}
+
+// Function to estimate the false-positive rate from the share of set bits
+double bloomFalsePositiveRate(const struct bloom_filter *filter)
+{
+    uint64_t set = 0;
+    
+    if (filter->block_count == 0)
+    {
+        return 1.0;
+    }
+    for (uint32_t b = 0; b < filter->block_count; b++)
+    {
+        for (int w = 0; w < 8; w++)
+        {
+            set += __builtin_popcountll(filter->blocks[b][w]);
+        }
+    }
+    
+    double fill = (double)set / ((double)filter->block_count * 512);
+    double rate = 1.0;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        rate *= fill;
+    }
+    return rate;
+}
+
+// Function to rebuild a Bloom filter from the live rows of a table
+int bloomRebuild(struct bloom_filter *filter, const struct directory_table *table)
+{
+    if (bloomInit(filter, table->live_count * 2 + 64) != 0)
+    {
+        return -1;
+    }
+    
+    for (int row = 0; row < table->count; row++)
+    {
+        if (tableIsLive(table, row))
+        {
+            bloomAdd(filter, tableNumber(table, row));
+        }
+    }
+    return 0;
+}
+
+// Function to add a number to the directory's filter, growing it when full
+void bloomInsert(struct bloom_filter *filter, const struct directory_table *table, uint64_t number)
+{
+    if (filter->entries * BLOOM_BITS_PER_ENTRY >= (uint64_t)filter->block_count * 512)
+    {
+        bloomRebuild(filter, table);
+        return;
+    }
+    bloomAdd(filter, number);
+}
+
+// Compiled snapshot: a read-only, mmap-ready image of the directory.
+// Records are sorted by name; number_order lists them sorted by number.
+// Each key set has a minimal perfect hash (hash-and-displace): a key's
+// bucket holds a displacement that sends it to a unique slot, and the slot
+// holds the first record (or number_order position) with that key.
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t number_keys;
+    uint32_t number_buckets;
+    uint32_t name_keys;
+    uint32_t name_buckets;
+    uint64_t seed;
+    uint64_t records_offset;
+    uint64_t number_order_offset;
+    uint64_t number_disp_offset;
+    uint64_t number_slots_offset;
+    uint64_t name_disp_offset;
+    uint64_t name_slots_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t bloom_offset;
+    uint32_t bloom_blocks;
+    uint32_t reserved;
+};
+
+struct snapshot_record
+{
+    uint64_t number;
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+struct snapshot
+{
+    void *base;
+    size_t size;
+    const struct snapshot_header *header;
+    const struct snapshot_record *records;
+    const uint32_t *number_order;
+    const uint32_t *number_disp;
+    const uint32_t *number_slots;
+    const uint32_t *name_disp;
+    const uint32_t *name_slots;
+    const char *names;
+    struct bloom_filter bloom;
+};
+
+// Function to hash a name (FNV-1a)
+uint64_t hashName(const char *name, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    for (int i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Function to map a key hash and a displacement to a slot
+uint32_t mphSlot(uint64_t hash, uint32_t displacement, uint32_t keys)
+{
+    return mix64(hash ^ (displacement * 0x9e3779b97f4a7c15ULL)) % keys;
+}
+
+// Function to build a minimal perfect hash over distinct key hashes.
+// Fills disp[buckets]; returns 0 on success or -1 if a bucket cannot be placed.
+int mphBuild(const uint64_t *hashes, uint32_t keys, uint32_t buckets, uint32_t *disp)
+{
+    uint32_t *bucket_start = calloc(buckets + 1, sizeof(uint32_t));
+    uint32_t *members = malloc((keys + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc(buckets * sizeof(uint32_t));
+    uint32_t *size_count = NULL;
+    uint32_t *slots = malloc((keys + 1) * sizeof(uint32_t));
+    uint8_t *taken = calloc(keys + 1, 1);
+    int result = -1;
+    
+    if (bucket_start == NULL || members == NULL || order == NULL || slots == NULL || taken == NULL)
+    {
+        goto done;
+    }
+    
+    // Group keys by bucket
+    for (uint32_t i = 0; i < keys; i++)
+    {
+        bucket_start[hashes[i] % buckets + 1]++;
+    }
+    uint32_t largest = 0;
+    for (uint32_t b = 0; b < buckets; b++)
+    {
+        if (bucket_start[b + 1] > largest)
+        {
+            largest = bucket_start[b + 1];
+        }
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    uint32_t *fill = calloc(buckets, sizeof(uint32_t));
+    if (fill == NULL)
+    {
+        goto done;
+    }
+    for (uint32_t i = 0; i < keys; i++)
+    {
+        uint32_t b = hashes[i] % buckets;
+        members[bucket_start[b] + fill[b]++] = i;
+    }
+    free(fill);
+    
+    // Place the largest buckets first
+    size_count = calloc(largest + 2, sizeof(uint32_t));
+    if (size_count == NULL)
+    {
+        goto done;
+    }
+    for (uint32_t b = 0; b < buckets; b++)
+    {
+        size_count[largest - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (uint32_t i = 0; i <= largest; i++)
+    {
+        size_count[i + 1] += size_count[i];
+    }
+    for (uint32_t b = 0; b < buckets; b++)
+    {
+        order[size_count[largest - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+    }
+    
+    for (uint32_t i = 0; i < buckets; i++)
+    {
+        uint32_t b = order[i];
+        uint32_t first = bucket_start[b];
+        uint32_t size = bucket_start[b + 1] - first;
+        uint32_t d;
+        
+        disp[b] = 0;
+        for (d = 0; size > 0 && d < MPH_MAX_DISPLACEMENT; d++)
+        {
+            uint32_t placed = 0;
+            while (placed < size)
+            {
+                uint32_t slot = mphSlot(hashes[members[first + placed]], d, keys);
+                if (taken[slot])
+                {
+                    break;
+                }
+                taken[slot] = 1;
+                slots[placed++] = slot;
+            }
+            if (placed == size)
+            {
+                disp[b] = d;
+                break;
+            }
+            while (placed > 0)
+            {
+                taken[slots[--placed]] = 0;
+            }
+        }
+        if (d == MPH_MAX_DISPLACEMENT)
+        {
+            goto done;
+        }
+    }
+    result = 0;
+    
+done:
+    free(bucket_start);
+    free(members);
+    free(order);
+    free(size_count);
+    free(slots);
+    free(taken);
+    return result;
+}
+
+struct directory_table *sort_table;
+
+// Function to order two table rows by name, for qsort
+int compareRowsByName(const void *a, const void *b)
+{
+    int ra = *(const int *)a;
+    int rb = *(const int *)b;
+    return tableCompareName(sort_table, ra, tableNamePointer(sort_table, rb), tableNameLength(sort_table, rb),
+                            tableNamePrefix(sort_table, rb));
+}
+
+// Function to order two table rows by number, for qsort
+int compareRowsByNumber(const void *a, const void *b)
+{
+    uint64_t na = tableNumber(sort_table, *(const int *)a);
+    uint64_t nb = tableNumber(sort_table, *(const int *)b);
+    return (na > nb) - (na < nb);
+}
+
+// Function to write a section of the snapshot, padded to 8 bytes
+uint64_t writeSection(FILE *file, const void *data, size_t size)
+{
+    static const char padding[8];
+    uint64_t offset = ftell(file);
+    
+    if (size > 0)
+    {
+        fwrite(data, 1, size, file);
+    }
+    fwrite(padding, 1, (8 - size % 8) % 8, file);
+    return offset;
+}
+
+// Function to compile the live rows of a table into a snapshot file
+int compileSnapshot(struct directory_table *table, const char *filename)
+{
+    uint32_t count = table->live_count;
+    int *rows = malloc((count + 1) * sizeof(int));
+    int *by_number = malloc((count + 1) * sizeof(int));
+    struct snapshot_record *records = malloc((count + 1) * sizeof(struct snapshot_record));
+    uint32_t *number_order = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *rank = malloc(((uint32_t)table->count + 1) * sizeof(uint32_t));
+    uint64_t *number_hashes = malloc((count + 1) * sizeof(uint64_t));
+    uint64_t *name_hashes = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t *number_firsts = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *name_firsts = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *number_disp = NULL;
+    uint32_t *name_disp = NULL;
+    uint32_t *number_slots = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *name_slots = malloc((count + 1) * sizeof(uint32_t));
+    char *names = malloc(table->names.used + 1);
+    struct bloom_filter filter = {0};
+    struct snapshot_header header;
+    struct atomic_file replace;
+    FILE *file = NULL;
+    int result = -1;
+    
+    if (!rows || !by_number || !records || !number_order || !rank || !number_hashes || !name_hashes ||
+        !number_firsts || !name_firsts || !number_slots || !name_slots || !names)
+    {
+        goto done;
+    }
+    
+    uint32_t live = 0;
+    for (int row = 0; row < table->count; row++)
+    {
+        if (tableIsLive(table, row))
+        {
+            rows[live++] = row;
+        }
+    }
+    sort_table = table;
+    qsort(rows, count, sizeof(int), compareRowsByName);
+    
+    // Lay out the records by name and collect the distinct names
+    uint32_t names_size = 0;
+    uint32_t name_keys = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int row = rows[i];
+        records[i].number = tableNumber(table, row);
+        records[i].name_offset = names_size;
+        records[i].name_length = tableNameLength(table, row);
+        memcpy(names + names_size, tableNamePointer(table, row), records[i].name_length);
+        names_size += records[i].name_length;
+        rank[row] = i;
+        
+        if (i == 0 || compareRowsByName(&rows[i - 1], &rows[i]) != 0)
+        {
+            name_firsts[name_keys++] = i;
+        }
+    }
+    
+    // Order the records by number and collect the distinct numbers
+    memcpy(by_number, rows, count * sizeof(int));
+    qsort(by_number, count, sizeof(int), compareRowsByNumber);
+    uint32_t number_keys = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        number_order[i] = rank[by_number[i]];
+        if (i == 0 || tableNumber(table, by_number[i - 1]) != tableNumber(table, by_number[i]))
+        {
+            number_firsts[number_keys++] = i;
+        }
+    }
+    
+    // Build both perfect hashes, retrying with a new seed on failure
+    uint32_t number_buckets = number_keys / MPH_BUCKET_SIZE + 1;
+    uint32_t name_buckets = name_keys / MPH_BUCKET_SIZE + 1;
+    number_disp = malloc(number_buckets * sizeof(uint32_t));
+    name_disp = malloc(name_buckets * sizeof(uint32_t));
+    if (number_disp == NULL || name_disp == NULL)
+    {
+        goto done;
+    }
+    
+    uint64_t seed;
+    for (seed = 1; seed < 16; seed++)
+    {
+        for (uint32_t i = 0; i < number_keys; i++)
+        {
+            number_hashes[i] = mix64(records[number_order[number_firsts[i]]].number ^ seed);
+        }
+        for (uint32_t i = 0; i < name_keys; i++)
+        {
+            const struct snapshot_record *record = &records[name_firsts[i]];
+            name_hashes[i] = mix64(hashName(names + record->name_offset, record->name_length) ^ seed);
+        }
+        if (mphBuild(number_hashes, number_keys, number_buckets, number_disp) == 0 &&
+            mphBuild(name_hashes, name_keys, name_buckets, name_disp) == 0)
+        {
+            break;
+        }
+    }
+    if (seed == 16)
+    {
+        printf("Unable to build the perfect hash.\n");
+        goto done;
+    }
+    
+    for (uint32_t i = 0; i < number_keys; i++)
+    {
+        uint64_t h = number_hashes[i];
+        number_slots[mphSlot(h, number_disp[h % number_buckets], number_keys)] = number_firsts[i];
+    }
+    for (uint32_t i = 0; i < name_keys; i++)
+    {
+        uint64_t h = name_hashes[i];
+        name_slots[mphSlot(h, name_disp[h % name_buckets], name_keys)] = name_firsts[i];
+    }
+    
+    if (bloomRebuild(&filter, table) != 0)
+    {
+        goto done;
+    }
+    
+    file = atomicOpen(&replace, filename, "wb");
+    if (file == NULL)
+    {
+        printf("Unable to create the file.");
+        goto done;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, file);
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    header.number_keys = number_keys;
+    header.number_buckets = number_buckets;
+    header.name_keys = name_keys;
+    header.name_buckets = name_buckets;
+    header.seed = seed;
+    header.records_offset = writeSection(file, records, count * sizeof(struct snapshot_record));
+    header.number_order_offset = writeSection(file, number_order, count * sizeof(uint32_t));
+    header.number_disp_offset = writeSection(file, number_disp, number_buckets * sizeof(uint32_t));
+    header.number_slots_offset = writeSection(file, number_slots, number_keys * sizeof(uint32_t));
+    header.name_disp_offset = writeSection(file, name_disp, name_buckets * sizeof(uint32_t));
+    header.name_slots_offset = writeSection(file, name_slots, name_keys * sizeof(uint32_t));
+    header.names_offset = writeSection(file, names, names_size);
+    header.names_size = names_size;
+    header.bloom_blocks = filter.block_count;
+    header.bloom_offset = writeSection(file, filter.blocks, filter.block_count * sizeof(*filter.blocks));
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    result = atomicCommit(&replace);
+    
+done:
+    free(rows);
+    free(by_number);
+    free(records);
+    free(number_order);
+    free(rank);
+    free(number_hashes);
+    free(name_hashes);
+    free(number_firsts);
+    free(name_firsts);
+    free(number_disp);
+    free(name_disp);
+    free(number_slots);
+    free(name_slots);
+    free(names);
+    free(filter.blocks);
+    return result;
+}
+
+// Function to check that a section lies inside the mapped snapshot
+int sectionFits(const struct snapshot *snap, uint64_t offset, uint64_t size)
+{
+    return offset % 8 == 0 && offset <= snap->size && size <= snap->size - offset;
+}
+
+// Function to map a snapshot file and validate its layout
+int openSnapshot(const char *filename, struct snapshot *snap)
+{
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(struct snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+    
+    snap->size = info.st_size;
+    snap->base = mmap(NULL, snap->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap->base == MAP_FAILED)
+    {
+        return -1;
+    }
+    
+    const struct snapshot_header *h = snap->base;
+    const char *base = snap->base;
+    snap->header = h;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != SNAPSHOT_VERSION ||
+        h->number_keys > h->count || h->name_keys > h->count ||
+        !sectionFits(snap, h->records_offset, (uint64_t)h->count * sizeof(struct snapshot_record)) ||
+        !sectionFits(snap, h->number_order_offset, (uint64_t)h->count * sizeof(uint32_t)) ||
+        !sectionFits(snap, h->number_disp_offset, (uint64_t)h->number_buckets * sizeof(uint32_t)) ||
+        !sectionFits(snap, h->number_slots_offset, (uint64_t)h->number_keys * sizeof(uint32_t)) ||
+        !sectionFits(snap, h->name_disp_offset, (uint64_t)h->name_buckets * sizeof(uint32_t)) ||
+        !sectionFits(snap, h->name_slots_offset, (uint64_t)h->name_keys * sizeof(uint32_t)) ||
+        !sectionFits(snap, h->names_offset, h->names_size) ||
+        !sectionFits(snap, h->bloom_offset, (uint64_t)h->bloom_blocks * 64) ||
+        h->number_buckets == 0 || h->name_buckets == 0)
+    {
+        munmap(snap->base, snap->size);
+        return -1;
+    }
+    
+    snap->records = (const void *)(base + h->records_offset);
+    snap->number_order = (const void *)(base + h->number_order_offset);
+    snap->number_disp = (const void *)(base + h->number_disp_offset);
+    snap->number_slots = (const void *)(base + h->number_slots_offset);
+    snap->name_disp = (const void *)(base + h->name_disp_offset);
+    snap->name_slots = (const void *)(base + h->name_slots_offset);
+    snap->names = base + h->names_offset;
+    snap->bloom.block_count = h->bloom_blocks;
+    snap->bloom.entries = h->count;
+    snap->bloom.blocks = (void *)(base + h->bloom_offset);
+    return 0;
+}
+
+// Function to unmap a snapshot
+void closeSnapshot(struct snapshot *snap)
+{
+    munmap(snap->base, snap->size);
+}
+
+// Function to print one snapshot record
+void printSnapshotRecord(const struct snapshot *snap, const struct snapshot_record *record)
+{
+    char number[NUMBER_TEXT_SIZE];
+    int len = record->name_length;
+    
+    formatNumber(record->number, number);
+    printf("%.*s%*s%s\n", len, snap->names + record->name_offset, len < 20 ? 20 - len : 1, "", number);
+}
+
+// Function to look up a number in a snapshot; returns the match count
+int snapshotFindNumber(const struct snapshot *snap, uint64_t number)
+{
+    const struct snapshot_header *h = snap->header;
+    int found = 0;
+    
+    if (h->number_keys == 0 || !bloomMayContain(&snap->bloom, number))
+    {
+        return 0;
+    }
+    
+    uint64_t hash = mix64(number ^ h->seed);
+    uint32_t pos = snap->number_slots[mphSlot(hash, snap->number_disp[hash % h->number_buckets], h->number_keys)];
+    while (pos < h->count && snap->number_order[pos] < h->count &&
+           snap->records[snap->number_order[pos]].number == number)
+    {
+        printSnapshotRecord(snap, &snap->records[snap->number_order[pos]]);
+        found++;
+        pos++;
+    }
+    
+    return found;
+}
+
+// Function to look up a name in a snapshot; returns the match count
+int snapshotFindName(const struct snapshot *snap, const char *name)
+{
+    const struct snapshot_header *h = snap->header;
+    uint32_t len = strlen(name);
+    int found = 0;
+    
+    if (h->name_keys == 0)
+    {
+        return 0;
+    }
+    
+    uint64_t hash = mix64(hashName(name, len) ^ h->seed);
+    uint32_t pos = snap->name_slots[mphSlot(hash, snap->name_disp[hash % h->name_buckets], h->name_keys)];
+    while (pos < h->count)
+    {
+        const struct snapshot_record *record = &snap->records[pos];
+        if (record->name_length != len || (uint64_t)record->name_offset + len > h->names_size ||
+            memcmp(snap->names + record->name_offset, name, len) != 0)
+        {
+            break;
+        }
+        printSnapshotRecord(snap, record);
+        found++;
+        pos++;
+    }
+    
+    return found;
+}
+
+// Result cache for hot name and number lookups. It is direct-mapped, so a
+// hit is one probe, and it remembers the matching rows (or that there were
+// none). A count-min sketch estimates how often each key is asked for; on a
+// miss the new key only replaces the slot's occupant if it is asked for
+// more often (TinyLFU admission). Counters are halved every
+// SKETCH_RESET_SAMPLES lookups so old popularity fades.
+struct lookup_slot
+{
+    uint8_t used;
+    uint8_t kind;
+    uint8_t row_count;
+    uint8_t name_length;
+    uint64_t number;
+    char name[LOOKUP_NAME_SIZE];
+    int rows[LOOKUP_MAX_ROWS];
+};
+
+struct lookup_cache
+{
+    struct lookup_slot slots[LOOKUP_CACHE_SLOTS];
+    uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    uint32_t samples;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;
+    uint64_t rejected;
+};
+
+struct lookup_cache lookup_cache;
+
+// Function to hash a lookup key
+uint64_t lookupHash(int kind, const char *name, uint64_t number)
+{
+    return kind == LOOKUP_BY_NAME ? mix64(hashName(name, strlen(name))) : mix64(number ^ 0x5bd1e995);
+}
+
+// Function to count one request for a key in the sketch
+void sketchIncrement(struct lookup_cache *cache, uint64_t hash)
+{
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        uint8_t *counter = &cache->sketch[i][(hash >> (16 * i)) % SKETCH_WIDTH];
+        if (*counter < 15)
+        {
+            (*counter)++;
+        }
+    }
+    
+    if (++cache->samples >= SKETCH_RESET_SAMPLES)
+    {
+        for (int i = 0; i < SKETCH_DEPTH; i++)
+        {
+            for (int j = 0; j < SKETCH_WIDTH; j++)
+            {
+                cache->sketch[i][j] >>= 1;
+            }
+        }
+        cache->samples = 0;
+    }
+}
+
+// Function to estimate how often a key has been requested
+int sketchEstimate(const struct lookup_cache *cache, uint64_t hash)
+{
+    int estimate = 15;
+    
+    for (int i = 0; i < SKETCH_DEPTH; i++)
+    {
+        int counter = cache->sketch[i][(hash >> (16 * i)) % SKETCH_WIDTH];
+        if (counter < estimate)
+        {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+// Function to check whether a slot holds a given key
+int lookupSlotMatches(const struct lookup_slot *slot, int kind, const char *name, uint64_t number)
+{
+    if (!slot->used || slot->kind != kind)
+    {
+        return 0;
+    }
+    if (kind == LOOKUP_BY_NUMBER)
+    {
+        return slot->number == number;
+    }
+    return slot->name_length == strlen(name) && memcmp(slot->name, name, slot->name_length) == 0;
+}
+
+// Function to fetch cached rows for a key; returns the row count or -1 on a miss
+int lookupCacheGet(struct lookup_cache *cache, int kind, const char *name, uint64_t number, int *rows)
+{
+    uint64_t hash = lookupHash(kind, name, number);
+    const struct lookup_slot *slot = &cache->slots[hash % LOOKUP_CACHE_SLOTS];
+    
+    sketchIncrement(cache, hash);
+    if (!lookupSlotMatches(slot, kind, name, number))
+    {
+        cache->misses++;
+        return -1;
+    }
+    
+    cache->hits++;
+    memcpy(rows, slot->rows, slot->row_count * sizeof(int));
+    return slot->row_count;
+}
+
+// Function to offer a lookup result to the cache
+void lookupCachePut(struct lookup_cache *cache, int kind, const char *name, uint64_t number, const int *rows, int count)
+{
+    uint64_t hash = lookupHash(kind, name, number);
+    struct lookup_slot *slot = &cache->slots[hash % LOOKUP_CACHE_SLOTS];
+    int name_length = kind == LOOKUP_BY_NAME ? strlen(name) : 0;
+    
+    if (count > LOOKUP_MAX_ROWS || name_length > LOOKUP_NAME_SIZE)
+    {
+        return;
+    }
+    
+    if (slot->used)
+    {
+        char victim_name[LOOKUP_NAME_SIZE + 1];
+        memcpy(victim_name, slot->name, slot->name_length);
+        victim_name[slot->name_length] = '\0';
+        uint64_t victim = lookupHash(slot->kind, victim_name, slot->number);
+        if (sketchEstimate(cache, hash) <= sketchEstimate(cache, victim))
+        {
+            cache->rejected++;
+            return;
+        }
+    }
+    
+    slot->used = 1;
+    slot->kind = kind;
+    slot->row_count = count;
+    slot->name_length = name_length;
+    slot->number = number;
+    memcpy(slot->name, name, name_length);
+    memcpy(slot->rows, rows, count * sizeof(int));
+    cache->admitted++;
+}
+
+// Function to drop any cached result for a name and for a number
+void lookupCacheInvalidate(struct lookup_cache *cache, const char *name, uint64_t number)
+{
+    struct lookup_slot *slot = &cache->slots[lookupHash(LOOKUP_BY_NAME, name, 0) % LOOKUP_CACHE_SLOTS];
+    if (lookupSlotMatches(slot, LOOKUP_BY_NAME, name, 0))
+    {
+        slot->used = 0;
+    }
+    
+    slot = &cache->slots[lookupHash(LOOKUP_BY_NUMBER, "", number) % LOOKUP_CACHE_SLOTS];
+    if (lookupSlotMatches(slot, LOOKUP_BY_NUMBER, "", number))
+    {
+        slot->used = 0;
+    }
+}
+
+// Function to drop cached results that involve a row's current values
+void lookupCacheInvalidateRow(struct lookup_cache *cache, const struct directory_table *table, int row)
+{
+    char name[MAX_NAME_LENGTH + 1];
+    
+    tableName(table, row, name);
+    lookupCacheInvalidate(cache, name, tableNumber(table, row));
+}
+
+// Epoch-based reclamation for lock-free reads. A reader announces the
+// global epoch in its own cache-line-sized slot while it holds pointers to
+// shared data and clears the slot when done, so readers never write a line
+// another thread reads. A writer publishes a new version with an atomic
+// pointer swap, retires the old one tagged with the current epoch and bumps
+// the epoch; the old version is released once every active reader has
+// announced a later epoch.
+struct epoch_slot
+{
+    uint64_t epoch;
+    int in_use;
+    char padding[64 - sizeof(uint64_t) - sizeof(int)];
+};
+
+struct retired_item
+{
+    void *item;
+    void *context;
+    void (*release)(void *, void *);
+    uint64_t epoch;
+    struct retired_item *next;
+};
+
+struct epoch_domain
+{
+    uint64_t global;
+    char padding[64 - sizeof(uint64_t)];
+    struct epoch_slot slots[EPOCH_MAX_THREADS];
+    pthread_mutex_t retire_lock;
+    struct retired_item *retired;
+};
+
+struct epoch_domain epochs = {1, {0}, {{0, 0, {0}}}, PTHREAD_MUTEX_INITIALIZER, NULL};
+__thread int epoch_slot_index = -1;
+pthread_key_t epoch_slot_key;
+pthread_once_t epoch_slot_key_once = PTHREAD_ONCE_INIT;
+
+// Function to give a thread's slot back when the thread exits, so
+// short-lived reader threads do not use up the slots
+void epochSlotRelease(void *argument)
+{
+    struct epoch_slot *slot = argument;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Function to create the key whose destructor releases epoch slots
+void epochSlotKeyCreate(void)
+{
+    pthread_key_create(&epoch_slot_key, epochSlotRelease);
+}
+
+// Function to mark the calling thread as reading shared data
+void epochEnter(struct epoch_domain *domain)
+{
+    if (epoch_slot_index < 0)
+    {
+        for (int i = 0; i < EPOCH_MAX_THREADS && epoch_slot_index < 0; i++)
+        {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&domain->slots[i].in_use, &expected, 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                epoch_slot_index = i;
+            }
+        }
+        if (epoch_slot_index < 0)
+        {
+            printf("Too many reader threads.\n");
+            exit(1);
+        }
+        pthread_once(&epoch_slot_key_once, epochSlotKeyCreate);
+        pthread_setspecific(epoch_slot_key, &domain->slots[epoch_slot_index]);
+    }
+    
+    uint64_t epoch = __atomic_load_n(&domain->global, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&domain->slots[epoch_slot_index].epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+// Function to mark the calling thread as done with shared data
+void epochExit(struct epoch_domain *domain)
+{
+    __atomic_store_n(&domain->slots[epoch_slot_index].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Function to release every retired item no reader can still see
+void epochReclaim(struct epoch_domain *domain)
+{
+    uint64_t oldest = UINT64_MAX;
+    
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&domain->slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+    
+    pthread_mutex_lock(&domain->retire_lock);
+    struct retired_item **link = &domain->retired;
+    struct retired_item *ready = NULL;
+    while (*link)
+    {
+        struct retired_item *item = *link;
+        if (item->epoch < oldest)
+        {
+            *link = item->next;
+            item->next = ready;
+            ready = item;
+        }
+        else
+        {
+            link = &item->next;
+        }
+    }
+    pthread_mutex_unlock(&domain->retire_lock);
+    
+    while (ready)
+    {
+        struct retired_item *next = ready->next;
+        ready->release(ready->item, ready->context);
+        free(ready);
+        ready = next;
+    }
+}
+
+// Function to hand an unpublished item to the domain for later release
+void epochRetire(struct epoch_domain *domain, void *item, void *context, void (*release)(void *, void *))
+{
+    struct retired_item *retired = malloc(sizeof(struct retired_item));
+    
+    if (retired == NULL)
+    {
+        // Without bookkeeping we cannot free it safely, so keep it forever
+        return;
+    }
+    retired->item = item;
+    retired->context = context;
+    retired->release = release;
+    
+    pthread_mutex_lock(&domain->retire_lock);
+    retired->epoch = __atomic_fetch_add(&domain->global, 1, __ATOMIC_SEQ_CST);
+    retired->next = domain->retired;
+    domain->retired = retired;
+    pthread_mutex_unlock(&domain->retire_lock);
+    
+    epochReclaim(domain);
+}
+
+// Function to release a retired item with plain free
+void releaseWithFree(void *item, void *context)
+{
+    (void)context;
+    free(item);
+}
+
+// LSM storage engine. Mutations go to a write-ahead log and a skiplist
+// memtable; a full memtable is written out as an immutable sorted run.
+// Runs are made of blocks that never split a record, plus a block index,
+// so a point read costs one binary search and one pread. A background
+// thread merges level 0 runs into level 1 and each level into the next
+// once it outgrows its budget. Keys are table row numbers, and each entry
+// carries the row's version so it survives a restart.
+struct lsm_entry
+{
+    uint32_t key;
+    uint8_t tombstone;
+    uint8_t name_length;
+    uint64_t number;
+    uint32_t version;
+    char name[MAX_NAME_LENGTH];
+};
+
+struct lsm_node
+{
+    struct lsm_entry entry;
+    int height;
+    struct lsm_node *next[LSM_MAX_HEIGHT];
+};
+
+struct lsm_block
+{
+    uint32_t first_key;
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct lsm_run
+{
+    uint32_t id;
+    uint32_t cache_id;
+    int level;
+    int fd;
+    uint32_t record_count;
+    uint32_t block_count;
+    struct lsm_block *blocks;
+};
+
+// Published, immutable list of runs from newest to oldest data. Readers
+// load it without locks inside an epoch; writers replace it wholesale.
+struct lsm_version
+{
+    int count;
+    struct lsm_run *runs[LSM_MAX_RUNS];
+};
+
+struct lsm_engine
+{
+    char prefix[FILENAME_SIZE - 32];
+    struct lsm_node head;
+    int memtable_count;
+    uint32_t rng;
+    FILE *log;
+    uint32_t next_run_id;
+    struct lsm_run *runs[LSM_MAX_RUNS];
+    int run_count;
+    struct lsm_version *version;
+    pthread_t compactor;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+};
+
+// Function to serialize an entry; returns the number of bytes written
+int lsmEncode(const struct lsm_entry *entry, unsigned char *buffer)
+{
+    memcpy(buffer, &entry->key, 4);
+    buffer[4] = entry->tombstone;
+    buffer[5] = entry->name_length;
+    memcpy(buffer + 6, &entry->number, 8);
+    memcpy(buffer + 14, &entry->version, 4);
+    memcpy(buffer + 18, entry->name, entry->name_length);
+    return LSM_RECORD_HEADER + entry->name_length;
+}
+
+// Function to deserialize an entry; returns the bytes consumed or -1
+int lsmDecode(const unsigned char *buffer, int size, struct lsm_entry *entry)
+{
+    if (size < LSM_RECORD_HEADER || size < LSM_RECORD_HEADER + buffer[5])
+    {
+        return -1;
+    }
+    memcpy(&entry->key, buffer, 4);
+    entry->tombstone = buffer[4];
+    entry->name_length = buffer[5];
+    memcpy(&entry->number, buffer + 6, 8);
+    memcpy(&entry->version, buffer + 14, 4);
+    memcpy(entry->name, buffer + 18, entry->name_length);
+    return LSM_RECORD_HEADER + entry->name_length;
+}
+
+// Function to build the name of one of the engine's files
+void lsmFileName(const struct lsm_engine *engine, const char *suffix, uint32_t id, char *filename)
+{
+    if (suffix == NULL)
+    {
+        snprintf(filename, FILENAME_SIZE, "%s.%u.run", engine->prefix, id);
+    }
+    else
+    {
+        snprintf(filename, FILENAME_SIZE, "%s.%s", engine->prefix, suffix);
+    }
+}
+
+// Function to insert or replace an entry in the memtable
+int memtablePut(struct lsm_engine *engine, const struct lsm_entry *entry)
+{
+    struct lsm_node *update[LSM_MAX_HEIGHT];
+    struct lsm_node *node = &engine->head;
+    
+    for (int level = LSM_MAX_HEIGHT - 1; level >= 0; level--)
+    {
+        while (node->next[level] && node->next[level]->entry.key < entry->key)
+        {
+            node = node->next[level];
+        }
+        update[level] = node;
+    }
+    
+    node = node->next[0];
+    if (node && node->entry.key == entry->key)
+    {
+        node->entry = *entry;
+        return 0;
+    }
+    
+    int height = 1;
+    engine->rng ^= engine->rng << 13;
+    engine->rng ^= engine->rng >> 17;
+    engine->rng ^= engine->rng << 5;
+    for (uint32_t bits = engine->rng; (bits & 3) == 0 && height < LSM_MAX_HEIGHT; bits >>= 2)
+    {
+        height++;
+    }
+    
+    node = malloc(sizeof(struct lsm_node));
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->entry = *entry;
+    node->height = height;
+    for (int level = 0; level < LSM_MAX_HEIGHT; level++)
+    {
+        node->next[level] = NULL;
+    }
+    for (int level = 0; level < height; level++)
+    {
+        node->next[level] = update[level]->next[level];
+        update[level]->next[level] = node;
+    }
+    engine->memtable_count++;
+    return 0;
+}
+
+// Function to find an entry in the memtable
+const struct lsm_entry *memtableGet(const struct lsm_engine *engine, uint32_t key)
+{
+    const struct lsm_node *node = &engine->head;
+    
+    for (int level = LSM_MAX_HEIGHT - 1; level >= 0; level--)
+    {
+        while (node->next[level] && node->next[level]->entry.key < key)
+        {
+            node = node->next[level];
+        }
+    }
+    
+    node = node->next[0];
+    return node && node->entry.key == key ? &node->entry : NULL;
+}
+
+// Function to empty the memtable
+void memtableClear(struct lsm_engine *engine)
+{
+    struct lsm_node *node = engine->head.next[0];
+    
+    while (node)
+    {
+        struct lsm_node *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    for (int level = 0; level < LSM_MAX_HEIGHT; level++)
+    {
+        engine->head.next[level] = NULL;
+    }
+    engine->memtable_count = 0;
+}
+
+// Batched positional I/O. A batch of reads or writes is queued on an
+// io_uring and completed through its ring with one system call, so a merge
+// keeps several blocks in flight at once. Each thread sets up its own ring
+// on first use; when the kernel has no usable io_uring the batch is served
+// with plain pread/pwrite instead.
+struct io_request
+{
+    int fd;
+    int write;
+    void *buffer;
+    uint32_t length;
+    uint64_t offset;
+    int result;
+};
+
+struct io_ring
+{
+    int fd;
+    unsigned entries;
+    void *sq_map;
+    size_t sq_size;
+    void *cq_map;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// fd is -1 until the ring is set up and -2 once io_uring proved unusable
+__thread struct io_ring io_ring = {.fd = -1};
+
+// Backend the last ring setup ended up with, for the statistics screen
+const char *io_backend = "pread/pwrite";
+
+// Function to set up the calling thread's ring; returns 0 or -1
+int ioRingSetup(struct io_ring *ring)
+{
+    struct io_uring_params params;
+    
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        ring->fd = -2;
+        return -1;
+    }
+    
+    // IORING_OP_READ and IORING_OP_WRITE arrived in the same kernel as the
+    // fast poll feature, so older rings are treated as unavailable
+    if (!(params.features & IORING_FEAT_FAST_POLL))
+    {
+        close(ring->fd);
+        ring->fd = -2;
+        return -1;
+    }
+    
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->sq_map != MAP_FAILED)
+        {
+            munmap(ring->sq_map, ring->sq_size);
+        }
+        if (ring->cq_map != MAP_FAILED)
+        {
+            munmap(ring->cq_map, ring->cq_size);
+        }
+        if (ring->sqes != MAP_FAILED)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        ring->fd = -2;
+        return -1;
+    }
+    
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    __atomic_store_n(&io_backend, "io_uring", __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Function to release the calling thread's ring, if it has one
+void ioRingClose()
+{
+    struct io_ring *ring = &io_ring;
+    
+    if (ring->fd >= 0)
+    {
+        munmap(ring->sq_map, ring->sq_size);
+        munmap(ring->cq_map, ring->cq_size);
+        munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+    }
+    ring->fd = -1;
+}
+
+// Function to serve a batch with blocking calls, one request at a time
+void ioSubmitBlocking(struct io_request *requests, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct io_request *request = &requests[i];
+        if (request->write)
+        {
+            request->result = pwrite(request->fd, request->buffer, request->length, request->offset);
+        }
+        else
+        {
+            request->result = pread(request->fd, request->buffer, request->length, request->offset);
+        }
+    }
+}
+
+// Function to run a batch of requests and wait for all of them. Each
+// request's result is its byte count, or negative on failure. Returns 0, or
+// -1 if the ring itself failed.
+int ioSubmit(struct io_request *requests, int count)
+{
+    struct io_ring *ring = &io_ring;
+    
+    if (ring->fd == -1)
+    {
+        ioRingSetup(ring);
+    }
+    if (ring->fd < 0)
+    {
+        ioSubmitBlocking(requests, count);
+        return 0;
+    }
+    
+    for (int first = 0; first < count; first += ring->entries)
+    {
+        int batch = count - first < (int)ring->entries ? count - first : (int)ring->entries;
+        unsigned tail = *ring->sq_tail;
+    
+        for (int i = 0; i < batch; i++)
+        {
+            struct io_request *request = &requests[first + i];
+            unsigned index = (tail + i) & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = request->fd;
+            sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+            sqe->len = request->length;
+            sqe->off = request->offset;
+            sqe->user_data = first + i;
+            ring->sq_array[index] = index;
+        }
+        __atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+    
+        int to_submit = batch;
+        int pending = batch;
+        while (pending > 0)
+        {
+            unsigned head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                requests[cqe->user_data].result = cqe->res;
+                head++;
+                pending--;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            if (pending == 0)
+            {
+                break;
+            }
+    
+            int submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            to_submit -= submitted;
+        }
+    }
+    return 0;
+}
+
+// Run ids are only unique within one engine, so the block cache keys runs
+// by an id handed out to every opened run in the process
+uint32_t next_cache_id = 0;
+
+// Function to open a run file and load its block index
+struct lsm_run *runOpen(const struct lsm_engine *engine, uint32_t id, int level)
+{
+    char filename[FILENAME_SIZE];
+    uint32_t footer[4];
+    struct lsm_run *run = calloc(1, sizeof(struct lsm_run));
+    
+    if (run == NULL)
+    {
+        return NULL;
+    }
+    
+    lsmFileName(engine, NULL, id, filename);
+    run->id = id;
+    run->cache_id = __atomic_add_fetch(&next_cache_id, 1, __ATOMIC_RELAXED);
+    run->level = level;
+    run->fd = open(filename, O_RDONLY);
+    if (run->fd < 0)
+    {
+        free(run);
+        return NULL;
+    }
+    
+    off_t size = lseek(run->fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(footer) || pread(run->fd, footer, sizeof(footer), size - sizeof(footer)) != sizeof(footer) ||
+        footer[3] != LSM_RUN_MAGIC)
+    {
+        close(run->fd);
+        free(run);
+        return NULL;
+    }
+    
+    // Footer: index offset, block count, record count, magic
+    run->block_count = footer[1];
+    run->record_count = footer[2];
+    run->blocks = malloc((run->block_count + 1) * sizeof(struct lsm_block));
+    size_t index_size = run->block_count * sizeof(struct lsm_block);
+    if (run->blocks == NULL || pread(run->fd, run->blocks, index_size, footer[0]) != (ssize_t)index_size)
+    {
+        close(run->fd);
+        free(run->blocks);
+        free(run);
+        return NULL;
+    }
+    return run;
+}
+
+// Function to close a run, optionally deleting its file
+void runClose(const struct lsm_engine *engine, struct lsm_run *run, int unlink_file)
+{
+    if (unlink_file)
+    {
+        char filename[FILENAME_SIZE];
+        lsmFileName(engine, NULL, run->id, filename);
+        unlink(filename);
+    }
+    close(run->fd);
+    free(run->blocks);
+    free(run);
+}
+
+// Function to read one block of a run into a buffer; returns its size or -1
+int runReadBlock(const struct lsm_run *run, uint32_t block, unsigned char *buffer)
+{
+    const struct lsm_block *info = &run->blocks[block];
+    
+    if (info->size > LSM_BLOCK_SIZE || pread(run->fd, buffer, info->size, info->offset) != (ssize_t)info->size)
+    {
+        return -1;
+    }
+    return info->size;
+}
+
+// Sharded LRU cache of run blocks, keyed by run cache id and block offset.
+// Cache ids are never reused, so blocks of deleted runs simply age out. Each
+// shard has its own lock so the compactor and readers rarely collide.
+struct cache_block
+{
+    uint32_t run_id;
+    uint32_t offset;
+    int size;
+    struct cache_block *hash_next;
+    struct cache_block *newer;
+    struct cache_block *older;
+    unsigned char data[];
+};
+
+struct cache_shard
+{
+    pthread_mutex_t lock;
+    struct cache_block *buckets[BLOCK_CACHE_BUCKETS];
+    struct cache_block *newest;
+    struct cache_block *oldest;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct block_cache
+{
+    size_t shard_budget;
+    struct cache_shard shards[BLOCK_CACHE_SHARDS];
+};
+
+struct block_cache block_cache;
+
+// Function to set up the block cache with a total byte budget
+void blockCacheInit(struct block_cache *cache, size_t budget)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->shard_budget = budget / BLOCK_CACHE_SHARDS;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    }
+}
+
+// Function to unlink a block from its shard's LRU list
+void cacheUnlink(struct cache_shard *shard, struct cache_block *block)
+{
+    if (block->newer)
+    {
+        block->newer->older = block->older;
+    }
+    else
+    {
+        shard->newest = block->older;
+    }
+    if (block->older)
+    {
+        block->older->newer = block->newer;
+    }
+    else
+    {
+        shard->oldest = block->newer;
+    }
+}
+
+// Function to put a block at the newest end of its shard's LRU list
+void cachePushNewest(struct cache_shard *shard, struct cache_block *block)
+{
+    block->newer = NULL;
+    block->older = shard->newest;
+    if (shard->newest)
+    {
+        shard->newest->newer = block;
+    }
+    shard->newest = block;
+    if (shard->oldest == NULL)
+    {
+        shard->oldest = block;
+    }
+}
+
+// Function to evict the oldest blocks until a shard fits its budget
+void cacheEvict(struct block_cache *cache, struct cache_shard *shard)
+{
+    while (shard->bytes > cache->shard_budget && shard->oldest)
+    {
+        struct cache_block *victim = shard->oldest;
+        uint32_t bucket = mix64(((uint64_t)victim->run_id << 32) | victim->offset) % BLOCK_CACHE_BUCKETS;
+        struct cache_block **link = &shard->buckets[bucket];
+        
+        while (*link != victim)
+        {
+            link = &(*link)->hash_next;
+        }
+        *link = victim->hash_next;
+        cacheUnlink(shard, victim);
+        shard->bytes -= victim->size;
+        free(victim);
+    }
+}
+
+// Function to read a run block through the cache; returns its size or -1
+int runReadBlockCached(const struct lsm_run *run, uint32_t block, unsigned char *buffer)
+{
+    const struct lsm_block *info = &run->blocks[block];
+    struct block_cache *cache = &block_cache;
+    
+    if (cache->shard_budget == 0)
+    {
+        return runReadBlock(run, block, buffer);
+    }
+    
+    uint64_t hash = mix64(((uint64_t)run->cache_id << 32) | info->offset);
+    struct cache_shard *shard = &cache->shards[(hash >> 32) % BLOCK_CACHE_SHARDS];
+    uint32_t bucket = hash % BLOCK_CACHE_BUCKETS;
+    
+    pthread_mutex_lock(&shard->lock);
+    for (struct cache_block *cached = shard->buckets[bucket]; cached; cached = cached->hash_next)
+    {
+        if (cached->run_id == run->cache_id && cached->offset == info->offset)
+        {
+            int size = cached->size;
+            memcpy(buffer, cached->data, size);
+            cacheUnlink(shard, cached);
+            cachePushNewest(shard, cached);
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return size;
+        }
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    
+    int size = runReadBlock(run, block, buffer);
+    if (size < 0)
+    {
+        return -1;
+    }
+    
+    struct cache_block *fresh = malloc(sizeof(struct cache_block) + size);
+    if (fresh == NULL)
+    {
+        return size;
+    }
+    fresh->run_id = run->cache_id;
+    fresh->offset = info->offset;
+    fresh->size = size;
+    memcpy(fresh->data, buffer, size);
+    
+    pthread_mutex_lock(&shard->lock);
+    for (struct cache_block *cached = shard->buckets[bucket]; cached; cached = cached->hash_next)
+    {
+        if (cached->run_id == run->cache_id && cached->offset == info->offset)
+        {
+            // Another thread cached it while we were reading
+            pthread_mutex_unlock(&shard->lock);
+            free(fresh);
+            return size;
+        }
+    }
+    fresh->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = fresh;
+    cachePushNewest(shard, fresh);
+    shard->bytes += size;
+    cacheEvict(cache, shard);
+    pthread_mutex_unlock(&shard->lock);
+    return size;
+}
+
+// Function to add up the hit and miss counters of every shard
+void blockCacheTotals(struct block_cache *cache, uint64_t *hits, uint64_t *misses, size_t *bytes)
+{
+    *hits = 0;
+    *misses = 0;
+    *bytes = 0;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        *hits += cache->shards[i].hits;
+        *misses += cache->shards[i].misses;
+        *bytes += cache->shards[i].bytes;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+// Function to free every cached block
+void blockCacheFree(struct block_cache *cache)
+{
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++)
+    {
+        struct cache_block *block = cache->shards[i].newest;
+        while (block)
+        {
+            struct cache_block *older = block->older;
+            free(block);
+            block = older;
+        }
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Function to find a key in a run; returns 1 if found, 0 if not, -1 on error
+int runGet(const struct lsm_run *run, uint32_t key, struct lsm_entry *entry)
+{
+    unsigned char buffer[LSM_BLOCK_SIZE];
+    uint32_t low = 0;
+    uint32_t high = run->block_count;
+    
+    // Find the last block whose first key is <= key
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+        if (run->blocks[mid].first_key <= key)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == 0)
+    {
+        return 0;
+    }
+    
+    int size = runReadBlockCached(run, low - 1, buffer);
+    if (size < 0)
+    {
+        return -1;
+    }
+    for (int pos = 0; pos < size; )
+    {
+        int used = lsmDecode(buffer + pos, size - pos, entry);
+        if (used < 0)
+        {
+            return -1;
+        }
+        if (entry->key == key)
+        {
+            return 1;
+        }
+        pos += used;
+    }
+    return 0;
+}
+
+// Sequential reader over one run, used by merges and scans. It bypasses
+// the block cache, so one-off reads do not flush hot blocks, and reads
+// ahead a window of blocks as one batch.
+struct run_cursor
+{
+    const struct lsm_run *run;
+    uint32_t block;
+    int size;
+    int pos;
+    const unsigned char *data;
+    int window_count;
+    int window_next;
+    unsigned char window[IO_BATCH_BLOCKS][LSM_BLOCK_SIZE];
+    struct lsm_entry entry;
+    int valid;
+};
+
+// Function to read the next window of blocks of an uncached cursor
+int cursorFill(struct run_cursor *cursor)
+{
+    struct io_request requests[IO_BATCH_BLOCKS];
+    int count = cursor->run->block_count - cursor->block;
+    
+    if (count > IO_BATCH_BLOCKS)
+    {
+        count = IO_BATCH_BLOCKS;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const struct lsm_block *info = &cursor->run->blocks[cursor->block + i];
+        if (info->size > LSM_BLOCK_SIZE)
+        {
+            return -1;
+        }
+        requests[i].fd = cursor->run->fd;
+        requests[i].write = 0;
+        requests[i].buffer = cursor->window[i];
+        requests[i].length = info->size;
+        requests[i].offset = info->offset;
+    }
+    
+    if (ioSubmit(requests, count) != 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (requests[i].result != (int)requests[i].length)
+        {
+            return -1;
+        }
+    }
+    cursor->window_count = count;
+    cursor->window_next = 0;
+    return 0;
+}
+
+// Function to move a run cursor to its next entry
+int cursorNext(struct run_cursor *cursor)
+{
+    while (cursor->pos >= cursor->size)
+    {
+        if (cursor->block >= cursor->run->block_count)
+        {
+            cursor->valid = 0;
+            return 0;
+        }
+        if (cursor->window_next < cursor->window_count || cursorFill(cursor) == 0)
+        {
+            cursor->data = cursor->window[cursor->window_next++];
+            cursor->size = cursor->run->blocks[cursor->block].size;
+        }
+        else
+        {
+            cursor->size = -1;
+        }
+        cursor->block++;
+        cursor->pos = 0;
+        if (cursor->size < 0)
+        {
+            cursor->valid = 0;
+            return -1;
+        }
+    }
+    
+    int used = lsmDecode(cursor->data + cursor->pos, cursor->size - cursor->pos, &cursor->entry);
+    if (used < 0)
+    {
+        cursor->valid = 0;
+        return -1;
+    }
+    cursor->pos += used;
+    cursor->valid = 1;
+    return 1;
+}
+
+// Function to merge runs (newest first) plus an optional memtable into a
+// callback in key order; the newest version of each key wins
+int lsmMerge(const struct lsm_node *memtable, struct lsm_run **runs, int run_count, int drop_tombstones,
+             int (*emit)(const struct lsm_entry *, void *), void *context)
+{
+    struct run_cursor *cursors = malloc((run_count + 1) * sizeof(struct run_cursor));
+    const struct lsm_node *node = memtable;
+    int result = 0;
+    
+    if (cursors == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < run_count; i++)
+    {
+        cursors[i].run = runs[i];
+        cursors[i].block = 0;
+        cursors[i].size = 0;
+        cursors[i].pos = 0;
+        cursors[i].window_count = 0;
+        cursors[i].window_next = 0;
+        if (cursorNext(&cursors[i]) < 0)
+        {
+            result = -1;
+        }
+    }
+    
+    while (result == 0)
+    {
+        const struct lsm_entry *best = node ? &node->entry : NULL;
+        for (int i = 0; i < run_count; i++)
+        {
+            if (cursors[i].valid && (best == NULL || cursors[i].entry.key < best->key))
+            {
+                best = &cursors[i].entry;
+            }
+        }
+        if (best == NULL)
+        {
+            break;
+        }
+    
+        struct lsm_entry winner = *best;
+        if (node && node->entry.key == winner.key)
+        {
+            node = node->next[0];
+        }
+        for (int i = 0; i < run_count; i++)
+        {
+            if (cursors[i].valid && cursors[i].entry.key == winner.key && cursorNext(&cursors[i]) < 0)
+            {
+                result = -1;
+            }
+        }
+    
+        if (!(drop_tombstones && winner.tombstone) && emit(&winner, context) != 0)
+        {
+            result = -1;
+        }
+    }
+    
+    free(cursors);
+    return result;
+}
+
+// Writer that packs entries into blocks of a new run file. Finished blocks
+// are held back and written out IO_BATCH_BLOCKS at a time.
+struct run_writer
+{
+    int fd;
+    unsigned char pending[IO_BATCH_BLOCKS][LSM_BLOCK_SIZE];
+    int pending_count;
+    unsigned char *block;
+    int block_used;
+    uint32_t offset;
+    uint32_t record_count;
+    uint32_t block_count;
+    uint32_t block_capacity;
+    struct lsm_block *blocks;
+};
+
+// Function to write the held-back blocks plus optional trailing data
+// (the index and footer) as one batch
+int writerSubmit(struct run_writer *writer, void *trailer, uint32_t trailer_size, uint32_t *footer)
+{
+    struct io_request requests[IO_BATCH_BLOCKS + 2];
+    int count = 0;
+    
+    for (int i = 0; i < writer->pending_count; i++)
+    {
+        const struct lsm_block *info = &writer->blocks[writer->block_count - writer->pending_count + i];
+        requests[count].buffer = writer->pending[i];
+        requests[count].length = info->size;
+        requests[count].offset = info->offset;
+        count++;
+    }
+    if (footer != NULL)
+    {
+        requests[count].buffer = trailer;
+        requests[count].length = trailer_size;
+        requests[count].offset = writer->offset;
+        count++;
+        requests[count].buffer = footer;
+        requests[count].length = 4 * sizeof(uint32_t);
+        requests[count].offset = writer->offset + trailer_size;
+        count++;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        requests[i].fd = writer->fd;
+        requests[i].write = 1;
+    }
+    
+    if (ioSubmit(requests, count) != 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (requests[i].result != (int)requests[i].length)
+        {
+            return -1;
+        }
+    }
+    writer->pending_count = 0;
+    writer->block = writer->pending[0];
+    return 0;
+}
+
+// Function to finish the block being filled
+int writerFlushBlock(struct run_writer *writer)
+{
+    if (writer->block_used == 0)
+    {
+        return 0;
+    }
+    writer->blocks[writer->block_count - 1].size = writer->block_used;
+    writer->offset += writer->block_used;
+    writer->block_used = 0;
+    writer->pending_count++;
+    if (writer->pending_count == IO_BATCH_BLOCKS)
+    {
+        return writerSubmit(writer, NULL, 0, NULL);
+    }
+    writer->block = writer->pending[writer->pending_count];
+    return 0;
+}
+
+// Function to append an entry to a run writer (merge callback)
+int writerAdd(const struct lsm_entry *entry, void *context)
+{
+    struct run_writer *writer = context;
+    
+    if (writer->block_used + LSM_RECORD_HEADER + entry->name_length > LSM_BLOCK_SIZE)
+    {
+        if (writerFlushBlock(writer) != 0)
+        {
+            return -1;
+        }
+    }
+    if (writer->block_used == 0)
+    {
+        if (writer->block_count == writer->block_capacity)
+        {
+            uint32_t capacity = writer->block_capacity ? writer->block_capacity * 2 : 16;
+            struct lsm_block *blocks = realloc(writer->blocks, capacity * sizeof(struct lsm_block));
+            if (blocks == NULL)
+            {
+                return -1;
+            }
+            writer->blocks = blocks;
+            writer->block_capacity = capacity;
+        }
+        writer->blocks[writer->block_count].first_key = entry->key;
+        writer->blocks[writer->block_count].offset = writer->offset;
+        writer->block_count++;
+    }
+    
+    writer->block_used += lsmEncode(entry, writer->block + writer->block_used);
+    writer->record_count++;
+    return 0;
+}
+
+// Function to build a run from a merge of sources; returns the new run or NULL
+struct lsm_run *lsmWriteRun(struct lsm_engine *engine, uint32_t id, int level, const struct lsm_node *memtable,
+                            struct lsm_run **inputs, int input_count, int drop_tombstones)
+{
+    char filename[FILENAME_SIZE];
+    struct run_writer writer;
+    
+    memset(&writer, 0, sizeof(writer));
+    writer.block = writer.pending[0];
+    lsmFileName(engine, NULL, id, filename);
+    writer.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer.fd < 0)
+    {
+        return NULL;
+    }
+    
+    int result = lsmMerge(memtable, inputs, input_count, drop_tombstones, writerAdd, &writer);
+    if (result == 0)
+    {
+        result = writerFlushBlock(&writer);
+    }
+    if (result == 0)
+    {
+        // The last blocks, the block index and the footer go out together
+        uint32_t footer[4] = {writer.offset, writer.block_count, writer.record_count, LSM_RUN_MAGIC};
+        result = writerSubmit(&writer, writer.blocks, writer.block_count * sizeof(struct lsm_block), footer);
+    }
+    
+    // The manifest may name this run as soon as it returns, so its data and
+    // directory entry must reach the disk first
+    if (result == 0 && (fsync(writer.fd) != 0 || syncDirectory(filename) != 0))
+    {
+        result = -1;
+    }
+    close(writer.fd);
+    free(writer.blocks);
+    
+    if (result != 0)
+    {
+        unlink(filename);
+        return NULL;
+    }
+    return runOpen(engine, id, level);
+}
+
+// Function to record the current set of runs; caller holds the lock
+int lsmSaveManifest(struct lsm_engine *engine)
+{
+    char filename[FILENAME_SIZE];
+    struct atomic_file replace;
+    
+    lsmFileName(engine, "manifest", 0, filename);
+    FILE *file = atomicOpen(&replace, filename, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    
+    fprintf(file, "next %u\n", engine->next_run_id);
+    for (int i = 0; i < engine->run_count; i++)
+    {
+        fprintf(file, "run %d %u\n", engine->runs[i]->level, engine->runs[i]->id);
+    }
+    return atomicCommit(&replace);
+}
+
+// Function to collect the runs of a level, newest first; caller holds the lock
+int lsmLevelRuns(struct lsm_engine *engine, int level, struct lsm_run **runs)
+{
+    int count = 0;
+    
+    for (int i = engine->run_count - 1; i >= 0; i--)
+    {
+        if (engine->runs[i]->level == level)
+        {
+            runs[count++] = engine->runs[i];
+        }
+    }
+    return count;
+}
+
+// Function to list every run from newest to oldest data: level 0 in
+// reverse flush order, then each deeper level; caller holds the lock
+int lsmOrderedRuns(struct lsm_engine *engine, struct lsm_run **runs)
+{
+    int count = 0;
+    
+    for (int level = 0; level < LSM_MAX_LEVELS; level++)
+    {
+        count += lsmLevelRuns(engine, level, runs + count);
+    }
+    return count;
+}
+
+// Function to publish the current run list to readers; caller holds the lock
+int lsmPublish(struct lsm_engine *engine)
+{
+    struct lsm_version *version = malloc(sizeof(struct lsm_version));
+    
+    if (version == NULL)
+    {
+        return -1;
+    }
+    version->count = lsmOrderedRuns(engine, version->runs);
+    
+    struct lsm_version *old = __atomic_exchange_n(&engine->version, version, __ATOMIC_SEQ_CST);
+    if (old)
+    {
+        epochRetire(&epochs, old, NULL, releaseWithFree);
+    }
+    return 0;
+}
+
+// Function to close and delete a run once no reader can reach it
+void runRetired(void *item, void *context)
+{
+    runClose(context, item, 1);
+}
+
+// Function to pick and run one compaction; returns 1 if work was done
+int lsmCompactOnce(struct lsm_engine *engine)
+{
+    struct lsm_run *inputs[LSM_MAX_RUNS];
+    int input_count = 0;
+    int target = -1;
+    int deepest = 0;
+    
+    pthread_mutex_lock(&engine->lock);
+    for (int i = 0; i < engine->run_count; i++)
+    {
+        if (engine->runs[i]->level > deepest)
+        {
+            deepest = engine->runs[i]->level;
+        }
+    }
+    
+    if (lsmLevelRuns(engine, 0, inputs) >= LSM_L0_LIMIT)
+    {
+        target = 1;
+    }
+    else
+    {
+        uint32_t budget = LSM_LEVEL_BASE;
+        for (int level = 1; level < LSM_MAX_LEVELS - 1; level++, budget *= LSM_LEVEL_RATIO)
+        {
+            struct lsm_run *runs[LSM_MAX_RUNS];
+            if (lsmLevelRuns(engine, level, runs) > 0 && runs[0]->record_count > budget)
+            {
+                target = level + 1;
+                break;
+            }
+        }
+    }
+    
+    if (target > 0)
+    {
+        input_count = lsmLevelRuns(engine, target - 1, inputs);
+        input_count += lsmLevelRuns(engine, target, inputs + input_count);
+    }
+    uint32_t id = engine->next_run_id++;
+    pthread_mutex_unlock(&engine->lock);
+    
+    if (target < 0)
+    {
+        return 0;
+    }
+    
+    // Inputs are immutable and only this thread removes runs, so the merge
+    // itself runs without the lock
+    struct lsm_run *output = lsmWriteRun(engine, id, target, NULL, inputs, input_count, target >= deepest);
+    if (output == NULL)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&engine->lock);
+    int kept = 0;
+    for (int i = 0; i < engine->run_count; i++)
+    {
+        int merged = 0;
+        for (int j = 0; j < input_count; j++)
+        {
+            merged |= engine->runs[i] == inputs[j];
+        }
+        if (!merged)
+        {
+            engine->runs[kept++] = engine->runs[i];
+        }
+    }
+    engine->runs[kept++] = output;
+    engine->run_count = kept;
+    lsmSaveManifest(engine);
+    lsmPublish(engine);
+    pthread_mutex_unlock(&engine->lock);
+    
+    // Readers may still be inside the old runs; close them once they leave
+    for (int j = 0; j < input_count; j++)
+    {
+        epochRetire(&epochs, inputs[j], engine, runRetired);
+    }
+    return 1;
+}
+
+// Function run by the background compaction thread
+void *lsmCompactor(void *argument)
+{
+    struct lsm_engine *engine = argument;
+    
+    while (1)
+    {
+        pthread_mutex_lock(&engine->lock);
+        if (engine->stopping)
+        {
+            pthread_mutex_unlock(&engine->lock);
+            ioRingClose();
+            return NULL;
+        }
+        pthread_mutex_unlock(&engine->lock);
+    
+        if (lsmCompactOnce(engine))
+        {
+            continue;
+        }
+    
+        pthread_mutex_lock(&engine->lock);
+        if (!engine->stopping)
+        {
+            pthread_cond_wait(&engine->wake, &engine->lock);
+        }
+        pthread_mutex_unlock(&engine->lock);
+    }
+}
+
+// Function to write the memtable out as a level 0 run and reset the log
+int lsmFlush(struct lsm_engine *engine)
+{
+    if (engine->memtable_count == 0)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&engine->lock);
+    if (engine->run_count >= LSM_MAX_RUNS - LSM_MAX_LEVELS)
+    {
+        // Let the compactor catch up before adding more runs
+        pthread_mutex_unlock(&engine->lock);
+        return 0;
+    }
+    uint32_t id = engine->next_run_id++;
+    pthread_mutex_unlock(&engine->lock);
+    
+    struct lsm_run *run = lsmWriteRun(engine, id, 0, engine->head.next[0], NULL, 0, 0);
+    if (run == NULL)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&engine->lock);
+    engine->runs[engine->run_count++] = run;
+    int saved = lsmSaveManifest(engine);
+    lsmPublish(engine);
+    pthread_cond_signal(&engine->wake);
+    pthread_mutex_unlock(&engine->lock);
+    if (saved != 0)
+    {
+        return -1;
+    }
+    
+    // The run is durable in the manifest, so the log can start over
+    char filename[FILENAME_SIZE];
+    lsmFileName(engine, "log", 0, filename);
+    fclose(engine->log);
+    engine->log = fopen(filename, "wb");
+    memtableClear(engine);
+    return engine->log ? 0 : -1;
+}
+
+// Function to apply one mutation: log it, then add it to the memtable.
+// The log record is synced before the call returns.
+int lsmApply(struct lsm_engine *engine, const struct lsm_entry *entry)
+{
+    unsigned char buffer[LSM_RECORD_HEADER + MAX_NAME_LENGTH];
+    int size = lsmEncode(entry, buffer);
+    
+    if (fwrite(buffer, 1, size, engine->log) != (size_t)size || fflush(engine->log) != 0 ||
+        fdatasync(fileno(engine->log)) != 0)
+    {
+        return -1;
+    }
+    if (memtablePut(engine, entry) != 0)
+    {
+        return -1;
+    }
+    if (engine->memtable_count >= LSM_MEMTABLE_LIMIT)
+    {
+        return lsmFlush(engine);
+    }
+    return 0;
+}
+
+// Function to apply several mutations as one log record with one sync.
+// The record starts with a header whose tombstone byte is LSM_LOG_BATCH,
+// key is the entry count and number the payload size; replay drops a torn
+// batch as a whole, so either every entry survives a crash or none does.
+int lsmApplyBatch(struct lsm_engine *engine, const struct lsm_entry *entries, int count)
+{
+    unsigned char buffer[LSM_RECORD_HEADER + TXN_MAX_ENTRIES * (LSM_RECORD_HEADER + MAX_NAME_LENGTH)];
+    struct lsm_entry header = {0};
+    int size = LSM_RECORD_HEADER;
+    
+    if (count > TXN_MAX_ENTRIES)
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        size += lsmEncode(&entries[i], buffer + size);
+    }
+    header.key = count;
+    header.tombstone = LSM_LOG_BATCH;
+    header.number = size - LSM_RECORD_HEADER;
+    lsmEncode(&header, buffer);
+    
+    if (fwrite(buffer, 1, size, engine->log) != (size_t)size || fflush(engine->log) != 0 ||
+        fdatasync(fileno(engine->log)) != 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (memtablePut(engine, &entries[i]) != 0)
+        {
+            return -1;
+        }
+    }
+    if (engine->memtable_count >= LSM_MEMTABLE_LIMIT)
+    {
+        return lsmFlush(engine);
+    }
+    return 0;
+}
+
+// Function to store a name and number under a key
+int lsmPut(struct lsm_engine *engine, uint32_t key, uint32_t version, const char *name, uint64_t number)
+{
+    struct lsm_entry entry;
+    
+    entry.key = key;
+    entry.tombstone = 0;
+    entry.name_length = strlen(name);
+    entry.number = number;
+    entry.version = version;
+    memcpy(entry.name, name, entry.name_length);
+    return lsmApply(engine, &entry);
+}
+
+// Function to delete a key
+int lsmDelete(struct lsm_engine *engine, uint32_t key, uint32_t version)
+{
+    struct lsm_entry entry;
+    
+    entry.key = key;
+    entry.tombstone = 1;
+    entry.name_length = 0;
+    entry.number = 0;
+    entry.version = version;
+    return lsmApply(engine, &entry);
+}
+
+// Function to read the newest version of a key; returns 1 if it is live
+int lsmGet(struct lsm_engine *engine, uint32_t key, struct lsm_entry *entry)
+{
+    const struct lsm_entry *found = memtableGet(engine, key);
+    int result = 0;
+    
+    if (found)
+    {
+        *entry = *found;
+        return !entry->tombstone;
+    }
+    
+    epochEnter(&epochs);
+    const struct lsm_version *version = __atomic_load_n(&engine->version, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < version->count && result == 0; i++)
+    {
+        result = runGet(version->runs[i], key, entry);
+    }
+    epochExit(&epochs);
+    return result == 1 && !entry->tombstone;
+}
+
+// Function to visit every key in order with its newest version
+int lsmScan(struct lsm_engine *engine, int (*emit)(const struct lsm_entry *, void *), void *context)
+{
+    struct lsm_run *runs[LSM_MAX_RUNS];
+    
+    epochEnter(&epochs);
+    const struct lsm_version *version = __atomic_load_n(&engine->version, __ATOMIC_ACQUIRE);
+    memcpy(runs, version->runs, version->count * sizeof(struct lsm_run *));
+    int result = lsmMerge(engine->head.next[0], runs, version->count, 0, emit, context);
+    epochExit(&epochs);
+    return result;
+}
+
+// Function to replay a batch record whose header is in buffer; returns 0,
+// or -1 when the batch is torn and must be dropped with the rest of the log
+int lsmReplayBatch(struct lsm_engine *engine, const unsigned char *buffer, FILE *file)
+{
+    unsigned char payload[TXN_MAX_ENTRIES * (LSM_RECORD_HEADER + MAX_NAME_LENGTH)];
+    struct lsm_entry entry;
+    uint32_t count;
+    uint64_t size;
+    
+    memcpy(&count, buffer, 4);
+    memcpy(&size, buffer + 6, 8);
+    if (count > TXN_MAX_ENTRIES || size > sizeof(payload) || fread(payload, 1, size, file) != size)
+    {
+        return -1;
+    }
+    
+    int position = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int used = lsmDecode(payload + position, size - position, &entry);
+        if (used < 0 || memtablePut(engine, &entry) != 0)
+        {
+            return -1;
+        }
+        position += used;
+    }
+    return 0;
+}
+
+// Function to replay the write-ahead log into the memtable
+int lsmReplayLog(struct lsm_engine *engine, const char *filename)
+{
+    unsigned char buffer[LSM_RECORD_HEADER + MAX_NAME_LENGTH];
+    struct lsm_entry entry;
+    FILE *file = fopen(filename, "rb");
+    
+    if (file == NULL)
+    {
+        return 0;
+    }
+    
+    // A torn record at the tail is dropped, and cut off so that records
+    // appended later are not read as part of it
+    long good = 0;
+    while (fread(buffer, 1, LSM_RECORD_HEADER, file) == LSM_RECORD_HEADER)
+    {
+        if (buffer[4] == LSM_LOG_BATCH)
+        {
+            if (lsmReplayBatch(engine, buffer, file) != 0)
+            {
+                break;
+            }
+            good = ftell(file);
+            continue;
+        }
+        if (fread(buffer + LSM_RECORD_HEADER, 1, buffer[5], file) != buffer[5])
+        {
+            break;
+        }
+        lsmDecode(buffer, LSM_RECORD_HEADER + buffer[5], &entry);
+        if (memtablePut(engine, &entry) != 0)
+        {
+            fclose(file);
+            return -1;
+        }
+        good = ftell(file);
+    }
+    
+    fclose(file);
+    return truncate(filename, good);
+}
+
+// Function to open (or create) an engine whose files start with prefix
+struct lsm_engine *lsmOpen(const char *prefix)
+{
+    char filename[FILENAME_SIZE];
+    char line[MAX_LINE];
+    struct lsm_engine *engine = calloc(1, sizeof(struct lsm_engine));
+    
+    if (engine == NULL)
+    {
+        return NULL;
+    }
+    snprintf(engine->prefix, sizeof(engine->prefix), "%s", prefix);
+    engine->rng = 0x2545f491;
+    engine->head.height = LSM_MAX_HEIGHT;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->wake, NULL);
+    
+    lsmFileName(engine, "manifest", 0, filename);
+    FILE *manifest = fopen(filename, "r");
+    if (manifest != NULL)
+    {
+        while (fgets(line, MAX_LINE, manifest) != NULL)
+        {
+            int level;
+            uint32_t id;
+            if (sscanf(line, "next %u", &id) == 1)
+            {
+                engine->next_run_id = id;
+            }
+            else if (sscanf(line, "run %d %u", &level, &id) == 2 && engine->run_count < LSM_MAX_RUNS)
+            {
+                struct lsm_run *run = runOpen(engine, id, level);
+                if (run == NULL)
+                {
+                    printf("Unable to open run %u.\n", id);
+                    continue;
+                }
+                engine->runs[engine->run_count++] = run;
+            }
+        }
+        fclose(manifest);
+    }
+    
+    lsmFileName(engine, "log", 0, filename);
+    if (lsmReplayLog(engine, filename) != 0)
+    {
+        goto failed;
+    }
+    engine->log = fopen(filename, "ab");
+    if (engine->log == NULL || lsmPublish(engine) != 0 || pthread_create(&engine->compactor, NULL, lsmCompactor, engine) != 0)
+    {
+        goto failed;
+    }
+    return engine;
+    
+failed:
+    // Nothing has been retired yet, so the version can be freed directly
+    free(engine->version);
+    for (int i = 0; i < engine->run_count; i++)
+    {
+        runClose(engine, engine->runs[i], 0);
+    }
+    memtableClear(engine);
+    if (engine->log)
+    {
+        fclose(engine->log);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->wake);
+    free(engine);
+    return NULL;
+}
+
+// Function to stop the compactor and release the engine; the log keeps
+// anything still in the memtable
+void lsmClose(struct lsm_engine *engine)
+{
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = 1;
+    pthread_cond_signal(&engine->wake);
+    pthread_mutex_unlock(&engine->lock);
+    pthread_join(engine->compactor, NULL);
+    
+    // No readers are left, so every retired run and version can go
+    epochReclaim(&epochs);
+    free(engine->version);
+    
+    for (int i = 0; i < engine->run_count; i++)
+    {
+        runClose(engine, engine->runs[i], 0);
+    }
+    memtableClear(engine);
+    fclose(engine->log);
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->wake);
+    free(engine);
+}
+
+// Function to add a scanned entry to the directory table; keys are rows
+int loadEntryIntoTable(const struct lsm_entry *entry, void *context)
+{
+    struct directory_table *table = context;
+    char name[MAX_NAME_LENGTH + 1];
+    
+    while ((uint32_t)table->count < entry->key)
+    {
+        int row = tableAppend(table, "", 0);
+        if (row < 0)
+        {
+            return -1;
+        }
+        tableDelete(table, row);
+    }
+    
+    memcpy(name, entry->name, entry->name_length);
+    name[entry->name_length] = '\0';
+    int row = tableAppend(table, name, entry->number);
+    if (row < 0)
+    {
+        return -1;
+    }
+    if (entry->tombstone)
+    {
+        tableDelete(table, row);
+    }
+    return tableSetVersion(table, row, entry->version);
+}
+
+// Sharded store: entries are hash-partitioned by number across shard_count
+// LSM engines, each with its own files, lock, block index and compaction
+// thread. Plain LSM mode is simply one shard. Keys stay table rows, so an
+// update that changes the number moves the key to its new shard.
+struct lsm_engine *shards[SHARD_MAX];
+int shard_count = 0;
+
+// Function to pick the shard that owns a number
+struct lsm_engine *shardFor(uint64_t number)
+{
+    return shards[mix64(number) % shard_count];
+}
+
+// Function to store a new entry in its shard
+int storeInsert(uint32_t key, uint32_t version, const char *name, uint64_t number)
+{
+    return lsmPut(shardFor(number), key, version, name, number);
+}
+
+// Function to write entries to the shards that own them, as one log
+// record per shard. A commit that spans shards is atomic for readers of
+// this process, but each shard's record survives a crash on its own.
+int storeApplyBatch(struct lsm_engine **owners, const struct lsm_entry *entries, int count)
+{
+    struct lsm_entry batch[TXN_MAX_ENTRIES];
+    char done[TXN_MAX_ENTRIES] = {0};
+    
+    for (int i = 0; i < count; i++)
+    {
+        int batch_count = 0;
+        if (done[i])
+        {
+            continue;
+        }
+        for (int j = i; j < count; j++)
+        {
+            if (owners[j] == owners[i])
+            {
+                batch[batch_count++] = entries[j];
+                done[j] = 1;
+            }
+        }
+        if (lsmApplyBatch(owners[i], batch, batch_count) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to read an entry from the shard that owns its number
+int storeGet(uint32_t key, uint64_t number, struct lsm_entry *entry)
+{
+    return lsmGet(shardFor(number), key, entry);
+}
+
+// Function to print a search result as stored. The read goes through the
+// block cache, so entries that are looked up often stay in memory.
+void storePrintRow(const struct directory_table *table, int row)
+{
+    struct lsm_entry entry;
+    char number[NUMBER_TEXT_SIZE];
+    
+    if (storeGet(row, tableNumber(table, row), &entry) != 1)
+    {
+        tablePrintRow(table, row);
+        return;
+    }
+    formatNumber(entry.number, number);
+    printf("Entry %d: %-20.*s %s\n", tableEntryForRow(table, row), entry.name_length, entry.name, number);
+}
+
+// One shard's scan result: its entries in key order
+struct shard_scan
+{
+    struct lsm_engine *engine;
+    int count;
+    int capacity;
+    struct lsm_entry *entries;
+    int result;
+};
+
+// Function to collect a scanned entry (scan callback)
+int collectShardEntry(const struct lsm_entry *entry, void *context)
+{
+    struct shard_scan *scan = context;
+    
+    if (scan->count == scan->capacity)
+    {
+        int capacity = scan->capacity ? scan->capacity * 2 : 1024;
+        struct lsm_entry *entries = realloc(scan->entries, capacity * sizeof(struct lsm_entry));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        scan->entries = entries;
+        scan->capacity = capacity;
+    }
+    memcpy(&scan->entries[scan->count], entry, offsetof(struct lsm_entry, name) + entry->name_length);
+    scan->count++;
+    return 0;
+}
+
+// Function run by one scan thread. The ring lsmScan set up for this
+// thread is closed before it returns; when storeLoad runs a scan inline
+// the main thread just sets up a new ring on its next read.
+void *scanShard(void *argument)
+{
+    struct shard_scan *scan = argument;
+    
+    scan->result = lsmScan(scan->engine, collectShardEntry, scan);
+    ioRingClose();
+    return NULL;
+}
+
+// Function to load every shard into the table, scanning shards in parallel
+// and merging their key-ordered results
+int storeLoad(struct directory_table *table)
+{
+    struct shard_scan scans[SHARD_MAX];
+    pthread_t threads[SHARD_MAX];
+    int positions[SHARD_MAX] = {0};
+    int result = 0;
+    
+    memset(scans, 0, sizeof(scans));
+    for (int i = 0; i < shard_count; i++)
+    {
+        scans[i].engine = shards[i];
+        if (pthread_create(&threads[i], NULL, scanShard, &scans[i]) != 0)
+        {
+            scanShard(&scans[i]);
+            threads[i] = 0;
+        }
+    }
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (threads[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        result |= scans[i].result;
+    }
+    
+    while (result == 0)
+    {
+        // A key found in several shards was moved: the newest version
+        // wins, and the new copy wins over the tombstone left behind
+        const struct lsm_entry *best = NULL;
+        for (int i = 0; i < shard_count; i++)
+        {
+            const struct lsm_entry *entry = positions[i] < scans[i].count ? &scans[i].entries[positions[i]] : NULL;
+            if (entry && (best == NULL || entry->key < best->key ||
+                          (entry->key == best->key && ((int32_t)(entry->version - best->version) > 0 ||
+                                                       (entry->version == best->version && best->tombstone)))))
+            {
+                best = entry;
+            }
+        }
+        if (best == NULL)
+        {
+            break;
+        }
+        
+        uint32_t key = best->key;
+        result = loadEntryIntoTable(best, table);
+        for (int i = 0; i < shard_count; i++)
+        {
+            if (positions[i] < scans[i].count && scans[i].entries[positions[i]].key == key)
+            {
+                positions[i]++;
+            }
+        }
+    }
+    
+    for (int i = 0; i < shard_count; i++)
+    {
+        free(scans[i].entries);
+    }
+    return result;
+}
+
+// Function to open the store with a number of shards; the count is kept in
+// a file so entries are never routed to the wrong shard
+int storeOpen(int count)
+{
+    char prefix[FILENAME_SIZE];
+    int saved = 0;
+    int recorded = 0;
+    FILE *file = fopen(SHARD_COUNT_FILENAME, "r");
+    
+    if (file != NULL)
+    {
+        recorded = fscanf(file, "%d", &saved) == 1;
+        fclose(file);
+        if (!recorded)
+        {
+            printf("Unable to read the shard count.\n");
+            return -1;
+        }
+    }
+    else if (access(LSM_PREFIX ".manifest", F_OK) == 0 || access(LSM_PREFIX ".log", F_OK) == 0)
+    {
+        // A store written before the count was recorded has one shard
+        saved = 1;
+    }
+    if (saved != 0 && saved != count)
+    {
+        printf("This directory uses %d shards.\n", saved);
+        return -1;
+    }
+    if (count < 1 || count > SHARD_MAX)
+    {
+        printf("The shard count must be between 1 and %d.\n", SHARD_MAX);
+        return -1;
+    }
+    
+    if (!recorded)
+    {
+        struct atomic_file replace;
+        file = atomicOpen(&replace, SHARD_COUNT_FILENAME, "w");
+        if (file == NULL)
+        {
+            return -1;
+        }
+        fprintf(file, "%d\n", count);
+        if (atomicCommit(&replace) != 0)
+        {
+            return -1;
+        }
+    }
+    
+    for (shard_count = 0; shard_count < count; shard_count++)
+    {
+        if (count == 1)
+        {
+            snprintf(prefix, sizeof(prefix), "%s", LSM_PREFIX);
+        }
+        else
+        {
+            snprintf(prefix, sizeof(prefix), "telephone_directory.shard%d.lsm", shard_count);
+        }
+        shards[shard_count] = lsmOpen(prefix);
+        if (shards[shard_count] == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to close every shard
+void storeClose()
+{
+    for (int i = 0; i < shard_count; i++)
+    {
+        lsmClose(shards[i]);
+    }
+    shard_count = 0;
+}
+
+// Change-data-capture feed. Every insert, update and delete is given the
+// next sequence number and placed in an in-memory ring; a background thread
+// appends the ring to the change log in batches, so the menu never waits
+// on the disk unless the ring fills up. Records are padded to 8 bytes and
+// hold the header followed by the new and the old name, so readers can use
+// them straight out of a mapping of the log.
+struct change_header
+{
+    uint64_t sequence;
+    uint64_t time_ms;
+    uint64_t number;
+    uint64_t old_number;
+    uint8_t op;
+    uint8_t name_length;
+    uint8_t old_name_length;
+    uint8_t flags;
+    uint8_t reserved[4];
+};
+
+struct change
+{
+    struct change_header header;
+    char names[2 * MAX_NAME_LENGTH + 8];
+};
+
+struct change_feed
+{
+    struct change ring[CHANGE_RING_SIZE];
+    uint64_t next_sequence;
+    uint64_t written;
+    FILE *log;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+    int running;
+    int stopping;
+};
+
+struct change_feed changes = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                              .space = PTHREAD_COND_INITIALIZER};
+
+// Function to get the new name of a change record
+const char *changeName(const struct change_header *header)
+{
+    return (const char *)(header + 1);
+}
+
+// Function to get the old name of a change record
+const char *changeOldName(const struct change_header *header)
+{
+    return changeName(header) + header->name_length;
+}
+
+// Function to get the size of a change record in the log
+size_t changeSize(const struct change_header *header)
+{
+    return (sizeof(*header) + header->name_length + header->old_name_length + 7) & ~(size_t)7;
+}
+
+// Function to get the wall-clock time in milliseconds
+uint64_t changeTimeMs()
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Function to deliver the logged changes from a sequence number on, in
+// batches of pointers into a read-only mapping of the log. The scan starts
+// at *offset and leaves it after the last whole record, so a reader can
+// call again later to pick up new changes. Returns the number of changes
+// delivered, or -1.
+int changeLogRead(const char *filename, uint64_t from, off_t *offset,
+                  int (*deliver)(const struct change_header **batch, int count, void *context), void *context)
+{
+    const struct change_header *batch[CHANGE_BATCH];
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    int count = 0;
+    int delivered = 0;
+    
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size <= *offset)
+    {
+        close(fd);
+        return 0;
+    }
+    
+    const unsigned char *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    
+    // Only whole transactions are delivered: complete is the end of the
+    // last one and complete_count its place in the batch. A transaction
+    // always fits in a batch, so a full batch holds at least one.
+    off_t position = *offset;
+    off_t complete = position;
+    int complete_count = 0;
+    while (position + (off_t)sizeof(struct change_header) <= info.st_size)
+    {
+        const struct change_header *header = (const struct change_header *)(map + position);
+        if (header->sequence == 0 || position + (off_t)changeSize(header) > info.st_size)
+        {
+            break;
+        }
+        position += changeSize(header);
+        if (header->sequence >= from)
+        {
+            batch[count++] = header;
+        }
+        if (!(header->flags & CHANGE_CONTINUED))
+        {
+            complete = position;
+            complete_count = count;
+        }
+    
+        if (count == CHANGE_BATCH)
+        {
+            if (deliver(batch, complete_count, context) != 0)
+            {
+                delivered = -1;
+                break;
+            }
+            delivered += complete_count;
+            count -= complete_count;
+            memmove(batch, batch + complete_count, count * sizeof(batch[0]));
+            complete_count = 0;
+        }
+    }
+    if (complete_count > 0 && delivered >= 0)
+    {
+        delivered = deliver(batch, complete_count, context) != 0 ? -1 : delivered + complete_count;
+    }
+    
+    *offset = complete;
+    munmap((void *)map, info.st_size);
+    return delivered;
+}
+
+// Function to remember the newest sequence number seen (log recovery)
+int changeTrackSequence(const struct change_header **batch, int count, void *context)
+{
+    *(uint64_t *)context = batch[count - 1]->sequence;
+    return 0;
+}
+
+// Function run by the change log writer thread
+void *changeLogWriter(void *argument)
+{
+    struct change_feed *feed = argument;
+    
+    pthread_mutex_lock(&feed->lock);
+    while (1)
+    {
+        while (feed->written == feed->next_sequence && !feed->stopping)
+        {
+            pthread_cond_wait(&feed->wake, &feed->lock);
+        }
+        if (feed->written == feed->next_sequence)
+        {
+            break;
+        }
+    
+        // Slots up to end stay put until written moves past them
+        uint64_t end = feed->next_sequence;
+        uint64_t sequence = feed->written;
+        pthread_mutex_unlock(&feed->lock);
+    
+        for (; sequence < end; sequence++)
+        {
+            const struct change *change = &feed->ring[sequence % CHANGE_RING_SIZE];
+            fwrite(change, 1, changeSize(&change->header), feed->log);
+        }
+        fflush(feed->log);
+        fdatasync(fileno(feed->log));
+    
+        pthread_mutex_lock(&feed->lock);
+        feed->written = end;
+        pthread_cond_broadcast(&feed->space);
+    }
+    pthread_mutex_unlock(&feed->lock);
+    return NULL;
+}
+
+// Function to open the change log, dropping a torn record at its end, and
+// start the writer thread; sequence numbers carry on from the log
+int changeFeedOpen(struct change_feed *feed)
+{
+    uint64_t last = 0;
+    off_t end = 0;
+    
+    if (changeLogRead(CHANGE_LOG_FILENAME, 0, &end, changeTrackSequence, &last) < 0)
+    {
+        return -1;
+    }
+    feed->log = fopen(CHANGE_LOG_FILENAME, "ab");
+    if (feed->log == NULL || ftruncate(fileno(feed->log), end) != 0)
+    {
+        return -1;
+    }
+    
+    feed->next_sequence = last + 1;
+    feed->written = last + 1;
+    feed->stopping = 0;
+    if (pthread_create(&feed->writer, NULL, changeLogWriter, feed) != 0)
+    {
+        fclose(feed->log);
+        return -1;
+    }
+    feed->running = 1;
+    return 0;
+}
+
+// Function to publish one change; old_name and old_number describe the
+// entry before an update or delete. CHANGE_CONTINUED in flags marks a
+// change that is followed by more of the same transaction. Waits only
+// while the ring is full.
+void changeEmit(struct change_feed *feed, int op, const char *name, uint64_t number, const char *old_name,
+                uint64_t old_number, int flags)
+{
+    if (!feed->running)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&feed->lock);
+    while (feed->next_sequence - feed->written >= CHANGE_RING_SIZE)
+    {
+        pthread_cond_wait(&feed->space, &feed->lock);
+    }
+    
+    struct change *change = &feed->ring[feed->next_sequence % CHANGE_RING_SIZE];
+    memset(&change->header, 0, sizeof(change->header));
+    change->header.sequence = feed->next_sequence;
+    change->header.time_ms = changeTimeMs();
+    change->header.op = op;
+    change->header.flags = flags;
+    change->header.number = number;
+    change->header.old_number = old_number;
+    change->header.name_length = strlen(name);
+    change->header.old_name_length = strlen(old_name);
+    memcpy(change->names, name, change->header.name_length);
+    memcpy(change->names + change->header.name_length, old_name, change->header.old_name_length);
+    memset(change->names + change->header.name_length + change->header.old_name_length, 0, 8);
+    
+    feed->next_sequence++;
+    pthread_cond_signal(&feed->wake);
+    pthread_mutex_unlock(&feed->lock);
+}
+
+// Function to write out the pending changes and stop the writer thread
+void changeFeedClose(struct change_feed *feed)
+{
+    if (!feed->running)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&feed->lock);
+    feed->stopping = 1;
+    pthread_cond_signal(&feed->wake);
+    pthread_mutex_unlock(&feed->lock);
+    pthread_join(feed->writer, NULL);
+    fclose(feed->log);
+    feed->running = 0;
+}
+
+// Function to print a batch of changes (changes command)
+int printChanges(const struct change_header **batch, int count, void *context)
+{
+    static const char *ops[] = {"clear", "insert", "update", "delete"};
+    char number[NUMBER_TEXT_SIZE];
+    char old_number[NUMBER_TEXT_SIZE];
+    
+    (void)context;
+    for (int i = 0; i < count; i++)
+    {
+        const struct change_header *header = batch[i];
+        formatNumber(header->number, number);
+        printf("%llu %llu %s", (unsigned long long)header->sequence, (unsigned long long)header->time_ms,
+               header->op <= CHANGE_DELETE ? ops[header->op] : "unknown");
+        if (header->op == CHANGE_INSERT || header->op == CHANGE_UPDATE)
+        {
+            printf(" %.*s %s", header->name_length, changeName(header), number);
+        }
+        if (header->op == CHANGE_UPDATE || header->op == CHANGE_DELETE)
+        {
+            formatNumber(header->old_number, old_number);
+            printf(" was %.*s %s", header->old_name_length, changeOldName(header), old_number);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// Function to print the change feed from a sequence number, optionally
+// waiting for more changes (changes command)
+int changesCommand(uint64_t from, int follow)
+{
+    off_t offset = 0;
+    
+    do
+    {
+        if (changeLogRead(CHANGE_LOG_FILENAME, from, &offset, printChanges, NULL) < 0)
+        {
+            printf("Unable to read the change log.\n");
+            return 1;
+        }
+        if (follow)
+        {
+            usleep(CHANGE_POLL_MS * 1000);
+        }
+    } while (follow);
+    return 0;
+}
+
+// Multi-operation transactions. Operations are staged, then validated and
+// committed together: store mode writes them as a single log record with
+// one sync, text mode rewrites the directory file atomically once, and the
+// table is only touched after that, all before the menu reads it again.
+struct transaction_op
+{
+    int op;
+    int row;
+    int check_version;
+    uint32_t version;
+    uint64_t number;
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+struct transaction
+{
+    int count;
+    struct transaction_op ops[TXN_MAX_OPS];
+};
+
+// Function to start an empty transaction
+void txnBegin(struct transaction *txn)
+{
+    txn->count = 0;
+}
+
+// Function to stage one operation; returns 0 or -1 when the transaction
+// is full or the name is too long. The row's version is only checked when
+// check_version is set, since every version value is a valid one.
+int txnStage(struct transaction *txn, int op, int row, int check_version, uint32_t version, const char *name,
+             uint64_t number)
+{
+    size_t len = strlen(name);
+    
+    if (txn->count == TXN_MAX_OPS || len > MAX_NAME_LENGTH)
+    {
+        return -1;
+    }
+    struct transaction_op *staged = &txn->ops[txn->count++];
+    staged->op = op;
+    staged->row = row;
+    staged->check_version = check_version;
+    staged->version = version;
+    staged->number = number;
+    memcpy(staged->name, name, len + 1);
+    return 0;
+}
+
+// Function to stage the insertion of a new entry
+int txnInsert(struct transaction *txn, const char *name, uint64_t number)
+{
+    return txnStage(txn, CHANGE_INSERT, -1, 0, 0, name, number);
+}
+
+// Function to stage the replacement of a row's name and number. The
+// commit fails with TXN_CONFLICT unless the row is still at version.
+int txnUpdate(struct transaction *txn, int row, uint32_t version, const char *name, uint64_t number)
+{
+    return txnStage(txn, CHANGE_UPDATE, row, 1, version, name, number);
+}
+
+// Function to stage the deletion of a row, checked against a version like
+// txnUpdate
+int txnDelete(struct transaction *txn, int row, uint32_t version)
+{
+    return txnStage(txn, CHANGE_DELETE, row, 1, version, "", 0);
+}
+
+// Function to check that every staged row is live, used only once and
+// still at the expected version; returns 0, -1 or TXN_CONFLICT
+int txnValidate(const struct transaction *txn)
+{
+    for (int i = 0; i < txn->count; i++)
+    {
+        int row = txn->ops[i].row;
+        if (txn->ops[i].op == CHANGE_INSERT)
+        {
+            continue;
+        }
+        if (row < 0 || row >= directory.count)
+        {
+            return -1;
+        }
+        if (!tableIsLive(&directory, row) ||
+            (txn->ops[i].check_version && tableVersion(&directory, row) != txn->ops[i].version))
+        {
+            return TXN_CONFLICT;
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (txn->ops[j].row == row)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to write a transaction to the shards as one record per shard
+int txnWriteStore(const struct transaction *txn)
+{
+    struct lsm_entry entries[TXN_MAX_ENTRIES];
+    struct lsm_engine *owners[TXN_MAX_ENTRIES];
+    struct lsm_entry moved[TXN_MAX_ENTRIES];
+    struct lsm_engine *moved_owners[TXN_MAX_ENTRIES];
+    int count = 0;
+    int moved_count = 0;
+    int next_row = directory.count;
+    
+    for (int i = 0; i < txn->count; i++)
+    {
+        const struct transaction_op *staged = &txn->ops[i];
+        int row = staged->op == CHANGE_INSERT ? next_row++ : staged->row;
+        struct lsm_engine *old_owner = staged->op == CHANGE_INSERT ? NULL : shardFor(tableNumber(&directory, row));
+        struct lsm_engine *new_owner = staged->op == CHANGE_DELETE ? NULL : shardFor(staged->number);
+        uint32_t version = staged->op == CHANGE_INSERT ? 1 : tableVersion(&directory, row) + 1;
+    
+        // A row that moves shard leaves a tombstone behind. It is written
+        // only after the new copy, so a crash in between leaves two live
+        // copies, and storeLoad keeps the one with the newer version.
+        if (old_owner != NULL && old_owner != new_owner)
+        {
+            memset(&moved[moved_count], 0, sizeof(moved[moved_count]));
+            moved[moved_count].key = row;
+            moved[moved_count].tombstone = 1;
+            moved[moved_count].version = version;
+            moved_owners[moved_count++] = old_owner;
+        }
+        if (new_owner != NULL)
+        {
+            entries[count].key = row;
+            entries[count].tombstone = 0;
+            entries[count].name_length = strlen(staged->name);
+            entries[count].number = staged->number;
+            entries[count].version = version;
+            memcpy(entries[count].name, staged->name, entries[count].name_length);
+            owners[count++] = new_owner;
+        }
+    }
+    if (storeApplyBatch(owners, entries, count) != 0)
+    {
+        return -1;
+    }
+    return storeApplyBatch(moved_owners, moved, moved_count);
+}
+
+// Function to apply a committed transaction to the in-memory state and
+// publish it to the change feed as one unit
+int txnApply(const struct transaction *txn)
+{
+    char old_name[MAX_NAME_LENGTH + 1];
+    
+    for (int i = 0; i < txn->count; i++)
+    {
+        const struct transaction_op *staged = &txn->ops[i];
+        int flags = i + 1 < txn->count ? CHANGE_CONTINUED : 0;
+    
+        if (staged->op == CHANGE_INSERT)
+        {
+            if (tableAppend(&directory, staged->name, staged->number) < 0)
+            {
+                return -1;
+            }
+            lookupCacheInvalidate(&lookup_cache, staged->name, staged->number);
+            bloomInsert(&bloom, &directory, staged->number);
+            changeEmit(&changes, CHANGE_INSERT, staged->name, staged->number, "", 0, flags);
+            continue;
+        }
+    
+        uint64_t old_number = tableNumber(&directory, staged->row);
+        tableName(&directory, staged->row, old_name);
+        lookupCacheInvalidateRow(&lookup_cache, &directory, staged->row);
+        if (staged->op == CHANGE_UPDATE)
+        {
+            lookupCacheInvalidate(&lookup_cache, staged->name, staged->number);
+            if (tableUpdate(&directory, staged->row, staged->name, staged->number) != 0)
+            {
+                return -1;
+            }
+            bloomInsert(&bloom, &directory, staged->number);
+        }
+        else
+        {
+            tableDelete(&directory, staged->row);
+        }
+        changeEmit(&changes, staged->op, staged->name, staged->number, old_name, old_number, flags);
+    }
+    return 0;
+}
+
+// Function to write the directory file as it will be after a transaction
+void txnExport(const struct transaction *txn, FILE *file)
+{
+    fprintf(file, "NAME                    NUMBER\n");
+    
+    for (int word = 0; word * 64 < directory.count; word++)
+    {
+        uint64_t mask = tableLiveWord(&directory, word);
+        while (mask)
+        {
+            int row = word * 64 + __builtin_ctzll(mask);
+            const struct transaction_op *staged = NULL;
+            mask &= mask - 1;
+    
+            for (int i = 0; i < txn->count; i++)
+            {
+                if (txn->ops[i].op != CHANGE_INSERT && txn->ops[i].row == row)
+                {
+                    staged = &txn->ops[i];
+                }
+            }
+            if (staged == NULL)
+            {
+                exportLine(file, tableNamePointer(&directory, row), tableNameLength(&directory, row),
+                           tableNumber(&directory, row));
+            }
+            else if (staged->op == CHANGE_UPDATE)
+            {
+                exportLine(file, staged->name, strlen(staged->name), staged->number);
+            }
+        }
+    }
+    for (int i = 0; i < txn->count; i++)
+    {
+        if (txn->ops[i].op == CHANGE_INSERT)
+        {
+            exportLine(file, txn->ops[i].name, strlen(txn->ops[i].name), txn->ops[i].number);
+        }
+    }
+}
+
+// Function to validate and commit a transaction. In text mode the caller
+// must not hold the directory file open, since it is replaced.
+int txnCommit(struct transaction *txn)
+{
+    if (txn->count == 0)
+    {
+        return 0;
+    }
+    int valid = txnValidate(txn);
+    if (valid != 0)
+    {
+        return valid;
+    }
+    
+    if (shard_count > 0)
+    {
+        if (txnWriteStore(txn) != 0)
+        {
+            return -1;
+        }
+        return txnApply(txn);
+    }
+    
+    // Text mode: the new file is written before the table changes, so a
+    // failed write leaves both as they were
+    struct atomic_file replace;
+    if (atomicOpen(&replace, "telephone_directory.txt", "w") == NULL)
+    {
+        return -1;
+    }
+    txnExport(txn, replace.file);
+    if (atomicCommit(&replace) != 0)
+    {
+        return -1;
+    }
+    return txnApply(txn);
+}
+
+// Function to replace a row's name and number only if it is still at the
+// version the caller read; returns 0, -1 or TXN_CONFLICT
+int compareAndUpdate(int row, uint32_t version, const char *name, uint64_t number)
+{
+    struct transaction txn;
+    
+    txnBegin(&txn);
+    txnUpdate(&txn, row, version, name, number);
+    return txnCommit(&txn);
+}
+
+// Function to delete a row only if it is still at the version the caller
+// read; returns 0, -1 or TXN_CONFLICT
+int compareAndDelete(int row, uint32_t version)
+{
+    struct transaction txn;
+    
+    txnBegin(&txn);
+    txnDelete(&txn, row, version);
+    return txnCommit(&txn);
+}
+
+// Function to swap the numbers of two entries in one transaction
+void swapNumbers()
+{
+    char first_name[MAX_NAME_LENGTH + 1];
+    char second_name[MAX_NAME_LENGTH + 1];
+    struct transaction txn;
+    int first;
+    int second;
+    
+    printf("Enter the first entry number: ");
+    scanf("%d", &first);
+    printf("Enter the second entry number: ");
+    scanf("%d", &second);
+    
+    int first_row = tableRowForEntry(&directory, first);
+    int second_row = tableRowForEntry(&directory, second);
+    if (first_row < 0 || second_row < 0)
+    {
+        printf("No such entry.\n");
+        return;
+    }
+    
+    tableName(&directory, first_row, first_name);
+    tableName(&directory, second_row, second_name);
+    txnBegin(&txn);
+    txnUpdate(&txn, first_row, tableVersion(&directory, first_row), first_name, tableNumber(&directory, second_row));
+    txnUpdate(&txn, second_row, tableVersion(&directory, second_row), second_name,
+              tableNumber(&directory, first_row));
+    if (txnCommit(&txn) != 0)
+    {
+        printf("Unable to swap the numbers.\n");
+        return;
+    }
+    printf("Numbers swapped.\n");
+}
+
+// Function to insert a new entry in the telephone directory
+void insertEntry(FILE *file)
+{
+    static int number = 1;
+    printf("Entry number %d: \n",number);
+    
+    fseek(file, 0, SEEK_END);
+    struct telephone newentry;
+    
+    printf("Enter the Name: ");
+    scanf(" %255[^\n]", newentry.name);
+    
+    char phone[NUMBER_INPUT_SIZE];
+    printf("Enter the phoneNumber: ");
+    scanf(" %31[^\n]", phone);
+    
+    // Only the canonical form is stored
+    uint64_t packed;
+    if (normalizeNumber(phone, &packed) != 0)
+    {
+        printf("Invalid phone number, use digits with an optional +country code.\n");
+        return;
+    }
+    
+    int row = tableAppend(&directory, newentry.name, packed);
+    lookupCacheInvalidate(&lookup_cache, newentry.name, packed);
+    if (shard_count > 0)
+    {
+        if (row < 0 || storeInsert(row, tableVersion(&directory, row), newentry.name, packed) != 0)
+        {
+            printf("Unable to store the entry.\n");
+            return;
+        }
+    }
+    else
+    {
+        exportLine(file, newentry.name, strlen(newentry.name), packed);
+    }
+    bloomInsert(&bloom, &directory, packed);
+    changeEmit(&changes, CHANGE_INSERT, newentry.name, packed, "", 0, 0);
+    printf("Entry inserted...\n");
+    number+=1;
+}
+
+// Function to replace a specific line of the file, or remove it when the
+// replacement is NULL; closes the file
+int rewriteFileLine(FILE *file, int line_number, const char *replacement)
+{
+    struct atomic_file replace;
+    FILE *temp_file = atomicOpen(&replace, "telephone_directory.txt", "w");
+    if (temp_file == NULL)
+    {
+        printf("Unable to open the temporary file.");
+        fclose(file);
+        return -1;
+    }
+    
+    char buffer[MAX_LINE];
+    int current_line = 1;
+    
+    while (fgets(buffer, MAX_LINE, file) != NULL)
+    {
+        if (current_line != line_number)
+        {
+            fputs(buffer, temp_file);
+        }
+        else if (replacement != NULL)
+        {
+            fputs(replacement, temp_file);
+        }
+        
+        current_line++;
+    }
+    
+    fclose(file);
+    if (atomicCommit(&replace) != 0)
+    {
+        printf("Unable to rewrite the file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to update an existing entry in the telephone directory
+void updateEntry()
+{
+    if (num > 0)
+    {
+        printf("Give the entry number n-%d...\n",num - 1);
+    }
+    
+    int entrynumber;
+    printf("Enter the entry number to update: ");
+    scanf("%d", &entrynumber);
+    entrynumber += 1;
+    fflush(stdin);
+    
+    // The version read here is checked again when writing, so an entry
+    // changed in the meantime is not silently overwritten
+    struct telephone existingEntry;
+    int row = tableRowForEntry(&directory, entrynumber - 1);
+    if (row < 0)
+    {
+        printf("No such entry.\n");
+        return;
+    }
+    uint32_t version = tableVersion(&directory, row);
+    if (shard_count > 0)
+    {
+        struct lsm_entry current;
+        char number[NUMBER_TEXT_SIZE];
+        if (storeGet(row, tableNumber(&directory, row), &current))
+        {
+            formatNumber(current.number, number);
+            printf("Current entry: %.*s %s (version %u)\n", current.name_length, current.name, number, version);
+        }
+    }
+    
+    printf("Enter Updated name: ");
+    scanf(" %255[^\n]", existingEntry.name);
+
+    char phone[NUMBER_INPUT_SIZE];
+    printf("Enter updated phoneNumber: ");
+    scanf(" %31[^\n]", phone);
+    
+    uint64_t packed;
+    if (normalizeNumber(phone, &packed) != 0)
+    {
+        printf("Invalid phone number, use digits with an optional +country code.\n");
+        return;
+    }
+    formatNumber(packed, existingEntry.number);
+    
+    if (shard_count > 0)
+    {
+        int result = compareAndUpdate(row, version, existingEntry.name, packed);
+        if (result == TXN_CONFLICT)
+        {
+            printf("The entry was changed by someone else, please try again.\n");
+            return;
+        }
+        if (result != 0)
+        {
+            printf("Unable to update the entry.\n");
+            return;
+        }
+        printf("Updated successfully...\n");
+        return;
+    }
+    
+    if (tableVersion(&directory, row) != version)
+    {
+        printf("The entry was changed by someone else, please try again.\n");
+        return;
+    }
+    
+    // Canonical numbers differ in length, so the line is rewritten rather
+    // than overwritten in place
+    char line[MAX_LINE];
+    int len = strlen(existingEntry.name);
+    snprintf(line, sizeof(line), "%s%*s%s\n", existingEntry.name, len < 20 ? 20 - len : 1, "", existingEntry.number);
+    FILE *file = fopen("telephone_directory.txt", "r");
+    if (file == NULL || rewriteFileLine(file, entrynumber, line) != 0)
+    {
+        printf("Unable to update the entry.\n");
+        return;
+    }
+    
+    char old_name[MAX_NAME_LENGTH + 1];
+    uint64_t old_number = tableNumber(&directory, row);
+    tableName(&directory, row, old_name);
+    lookupCacheInvalidateRow(&lookup_cache, &directory, row);
+    lookupCacheInvalidate(&lookup_cache, existingEntry.name, packed);
+    tableUpdate(&directory, row, existingEntry.name, packed);
+    bloomInsert(&bloom, &directory, packed);
+    changeEmit(&changes, CHANGE_UPDATE, existingEntry.name, packed, old_name, old_number, 0);
+    printf("Updated successfully...\n");
+}
+
+// Function to remove a specific line from the file; returns 0 or -1
+int RemoveLineFromFile(FILE *file, int line_number)
+{
+    if (rewriteFileLine(file, line_number, NULL) != 0)
+    {
+        return -1;
+    }
+    printf("Entry deleted successfully.\n");
+    return 0;
+}
+
+// Function to search the directory by name
+void searchByName()
+{
+    char name[MAX_NAME_LENGTH + 1];
+    void (*print)(const struct directory_table *, int) = shard_count > 0 ? storePrintRow : tablePrintRow;
+    
+    printf("Enter the Name to search: ");
+    scanf(" %255[^\n]", name);
+    
+    int rows[LOOKUP_MAX_ROWS];
+    int found = lookupCacheGet(&lookup_cache, LOOKUP_BY_NAME, name, 0, rows);
+    if (found >= 0)
+    {
+        for (int i = 0; i < found; i++)
+        {
+            print(&directory, rows[i]);
+        }
+    }
+    else
+    {
+        found = tableFindName(&directory, name, rows, LOOKUP_MAX_ROWS, print);
+        lookupCachePut(&lookup_cache, LOOKUP_BY_NAME, name, 0, rows, found);
+    }
+    
+    if (found == 0)
+    {
+        printf("No entry found.\n");
+    }
+}
+
+// Function to search the directory by phone number
+void searchByNumber()
+{
+    char number[NUMBER_INPUT_SIZE];
+    uint64_t packed;
+    void (*print)(const struct directory_table *, int) = shard_count > 0 ? storePrintRow : tablePrintRow;
+    
+    printf("Enter the phoneNumber to search: ");
+    scanf(" %31[^\n]", number);
+    
+    if (normalizeNumber(number, &packed) != 0)
+    {
+        printf("Invalid phone number, use digits with an optional +country code.\n");
+        return;
+    }
+    
+    if (!bloomMayContain(&bloom, packed))
+    {
+        bloom_negatives++;
+        printf("No entry found.\n");
+        return;
+    }
+    
+    int rows[LOOKUP_MAX_ROWS];
+    int found = lookupCacheGet(&lookup_cache, LOOKUP_BY_NUMBER, "", packed, rows);
+    if (found >= 0)
+    {
+        for (int i = 0; i < found; i++)
+        {
+            print(&directory, rows[i]);
+        }
+    }
+    else
+    {
+        found = tableFindNumber(&directory, packed, rows, LOOKUP_MAX_ROWS, print);
+        lookupCachePut(&lookup_cache, LOOKUP_BY_NUMBER, "", packed, rows, found);
+    }
+    
+    if (found == 0)
+    {
+        printf("No entry found.\n");
+    }
+}
+
+// Background export: the thread writes a pinned snapshot of the table,
+// so the menu stays usable and later changes never leak into the file
+struct export_job
+{
+    struct directory_table snapshot;
+    struct atomic_file replace;
+};
+
+pthread_t export_thread;
+int export_running = 0;
+
+// Function run by the export thread
+void *exportWorker(void *argument)
+{
+    struct export_job *job = argument;
+    
+    tableExport(&job->snapshot, job->replace.file);
+    if (atomicCommit(&job->replace) == 0)
+    {
+        printf("Exported %d entries.\n", job->snapshot.live_count);
+    }
+    else
+    {
+        printf("Unable to write the export file.\n");
+    }
+    tableFree(&job->snapshot);
+    free(job);
+    return NULL;
+}
+
+// Function to wait for a running background export
+void waitForExport()
+{
+    if (export_running)
+    {
+        pthread_join(export_thread, NULL);
+        export_running = 0;
+    }
+}
+
+// Function to export the directory to another file
+void exportDirectory()
+{
+    char filename[FILENAME_SIZE];
+    
+    printf("Enter the export file name: ");
+    scanf(" %1023[^\n]", filename);
+    waitForExport();
+    
+    struct export_job *job = malloc(sizeof(struct export_job));
+    if (job == NULL)
+    {
+        return;
+    }
+    if (atomicOpen(&job->replace, filename, "w") == NULL)
+    {
+        printf("Unable to open the file.");
+        free(job);
+        return;
+    }
+    
+    if (tableSnapshot(&directory, &job->snapshot) != 0)
+    {
+        atomicAbort(&job->replace);
+        free(job);
+        return;
+    }
+    
+    if (pthread_create(&export_thread, NULL, exportWorker, job) != 0)
+    {
+        exportWorker(job);
+        return;
+    }
+    export_running = 1;
+    printf("Export started.\n");
+}
+
+// Sorted listing. The live rows are ordered with a parallel LSD radix sort
+// over fixed-width keys: the first RADIX_NAME_BYTES of the name followed by
+// the number, or the number alone. Each pass counts digits per thread and
+// then scatters each thread's slice to its own offsets, which keeps the
+// sort stable; a pass where every key has the same byte is skipped. The
+// resulting row order is cached until the table's generation changes.
+struct radix_item
+{
+    unsigned char key[RADIX_KEY_SIZE];
+    int32_t row;
+};
+
+struct radix_job
+{
+    const struct radix_item *from;
+    struct radix_item *to;
+    int begin;
+    int end;
+    int byte;
+    size_t counts[256];
+};
+
+// A sorted index is shared by the listing cache and any cursor reading it,
+// so it is reference counted like the table pages
+struct sorted_index
+{
+    int refs;
+    uint64_t generation;
+    int count;
+    int rows[];
+};
+
+struct sorted_index *sorted_by[2];
+
+// Function to count the key digits of one slice (radix sort pass)
+void *radixCount(void *argument)
+{
+    struct radix_job *job = argument;
+    
+    memset(job->counts, 0, sizeof(job->counts));
+    for (int i = job->begin; i < job->end; i++)
+    {
+        job->counts[job->from[i].key[job->byte]]++;
+    }
+    return NULL;
+}
+
+// Function to move one slice to its sorted places; counts holds the
+// slice's starting offset for each digit
+void *radixScatter(void *argument)
+{
+    struct radix_job *job = argument;
+    
+    for (int i = job->begin; i < job->end; i++)
+    {
+        job->to[job->counts[job->from[i].key[job->byte]]++] = job->from[i];
+    }
+    return NULL;
+}
+
+// Function to run a radix pass step on every slice, in threads when there
+// is more than one
+void radixRun(struct radix_job *jobs, int threads, void *(*step)(void *))
+{
+    pthread_t ids[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS] = {0};
+    
+    for (int t = 1; t < threads; t++)
+    {
+        started[t] = pthread_create(&ids[t], NULL, step, &jobs[t]) == 0;
+        if (!started[t])
+        {
+            step(&jobs[t]);
+        }
+    }
+    step(&jobs[0]);
+    for (int t = 1; t < threads; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(ids[t], NULL);
+        }
+    }
+}
+
+// Function to sort items by key bytes 0..width-1; returns the array that
+// holds the result, either items or scratch
+struct radix_item *radixSort(struct radix_item *items, struct radix_item *scratch, int count, int width)
+{
+    struct radix_job jobs[SORT_MAX_THREADS];
+    long threads = count < RADIX_PARALLEL_MIN ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    
+    threads = threads < 1 ? 1 : threads > SORT_MAX_THREADS ? SORT_MAX_THREADS : threads;
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t].begin = (int)((long long)count * t / threads);
+        jobs[t].end = (int)((long long)count * (t + 1) / threads);
+    }
+    
+    for (int byte = width - 1; byte >= 0; byte--)
+    {
+        for (int t = 0; t < threads; t++)
+        {
+            jobs[t].from = items;
+            jobs[t].to = scratch;
+            jobs[t].byte = byte;
+        }
+        radixRun(jobs, threads, radixCount);
+    
+        // Offsets go digit by digit, and thread by thread within a digit
+        size_t offset = 0;
+        int skip = 0;
+        for (int digit = 0; digit < 256; digit++)
+        {
+            size_t total = 0;
+            for (int t = 0; t < threads; t++)
+            {
+                size_t slice = jobs[t].counts[digit];
+                jobs[t].counts[digit] = offset + total;
+                total += slice;
+            }
+            skip |= total == (size_t)count;
+            offset += total;
+        }
+        if (skip)
+        {
+            continue;
+        }
+    
+        radixRun(jobs, threads, radixScatter);
+        struct radix_item *swap = items;
+        items = scratch;
+        scratch = swap;
+    }
+    return items;
+}
+
+// Function to order two table rows by name, then number, then row, for qsort
+int compareRowsByNameThenNumber(const void *a, const void *b)
+{
+    int result = compareRowsByName(a, b);
+    result = result ? result : compareRowsByNumber(a, b);
+    return result ? result : *(const int *)a - *(const int *)b;
+}
+
+// Function to drop one reference to a sorted index
+void sortedIndexRelease(struct sorted_index *index)
+{
+    if (index != NULL && __atomic_sub_fetch(&index->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(index);
+    }
+}
+
+// Function to get the live rows of the directory sorted by name or number.
+// Ties are broken by row, so the order is total. The index is cached until
+// the next change to the table and stays owned by the cache; returns NULL
+// if memory runs out.
+struct sorted_index *directorySortedIndex(int field)
+{
+    struct sorted_index *cache = sorted_by[field];
+    
+    if (cache != NULL && cache->generation == directory.generation)
+    {
+        return cache;
+    }
+    
+    int live = directory.live_count;
+    struct radix_item *items = malloc((live + 1) * sizeof(struct radix_item));
+    struct radix_item *scratch = malloc((live + 1) * sizeof(struct radix_item));
+    struct sorted_index *index = malloc(sizeof(struct sorted_index) + (live + 1) * sizeof(int));
+    if (items == NULL || scratch == NULL || index == NULL)
+    {
+        free(items);
+        free(scratch);
+        free(index);
+        return NULL;
+    }
+    int *rows = index->rows;
+    
+    int n = 0;
+    for (int word = 0; word * 64 < directory.count; word++)
+    {
+        uint64_t mask = tableLiveWord(&directory, word);
+        while (mask)
+        {
+            int row = word * 64 + __builtin_ctzll(mask);
+            uint64_t number = tableNumber(&directory, row);
+            unsigned char *key = items[n].key;
+            mask &= mask - 1;
+    
+            memset(key, 0, RADIX_KEY_SIZE);
+            if (field == LOOKUP_BY_NAME)
+            {
+                int len = tableNameLength(&directory, row);
+                memcpy(key, tableNamePointer(&directory, row), len < RADIX_NAME_BYTES ? len : RADIX_NAME_BYTES);
+                key += RADIX_NAME_BYTES;
+            }
+            for (int i = 0; i < 8; i++)
+            {
+                key[i] = number >> (56 - 8 * i);
+            }
+            items[n++].row = row;
+        }
+    }
+    
+    int width = field == LOOKUP_BY_NAME ? RADIX_KEY_SIZE : 8;
+    struct radix_item *sorted = radixSort(items, scratch, n, width);
+    for (int i = 0; i < n; i++)
+    {
+        rows[i] = sorted[i].row;
+    }
+    
+    // Names longer than the key prefix tie on it; finish those groups
+    // with a full comparison
+    if (field == LOOKUP_BY_NAME)
+    {
+        sort_table = &directory;
+        for (int first = 0; first < n;)
+        {
+            int last = first + 1;
+            while (last < n && memcmp(sorted[last].key, sorted[first].key, RADIX_NAME_BYTES) == 0)
+            {
+                last++;
+            }
+            if (last - first > 1 && tableNameLength(&directory, rows[first]) >= RADIX_NAME_BYTES)
+            {
+                qsort(rows + first, last - first, sizeof(int), compareRowsByNameThenNumber);
+            }
+            first = last;
+        }
+    }
+    free(items);
+    free(scratch);
+    
+    index->refs = 1;
+    index->count = n;
+    index->generation = directory.generation;
+    sortedIndexRelease(cache);
+    sorted_by[field] = index;
+    return index;
+}
+
+// Streaming cursors. A cursor pins a snapshot of the table, and for the
+// name and number orders the sorted index of the same generation, then
+// hands out records in batches that point into the snapshot, so a reader
+// sees one consistent version however long it takes and memory stays flat.
+// The position after the last record handed out can be saved as an opaque
+// token. Resuming from a token opens a fresh snapshot and continues after
+// that key (row index, or name, number and row), so a resumed listing
+// skips nothing that was there and never repeats a record.
+//
+// Tokens end with a check keyed by a secret drawn when the process starts,
+// so a token that was edited, made up or issued by another run is refused.
+// Row numbers mean nothing outside the run that issued them anyway. The
+// check is not a cryptographic MAC: tokens only carry a listing position,
+// and a token accepted by mistake can at worst start a listing at another
+// position, which any user can ask for directly.
+struct directory_record
+{
+    int row;
+    int name_length;
+    const char *name;
+    uint64_t number;
+    uint32_t version;
+};
+
+struct cursor_position
+{
+    int order;
+    int row;
+    uint64_t number;
+    int name_length;
+    char name[MAX_NAME_LENGTH];
+};
+
+struct directory_cursor
+{
+    struct directory_table snapshot;
+    struct sorted_index *index;
+    struct cursor_position after;
+    int next;
+};
+
+// Function to get the value of a hex digit, or -1
+int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Key of the page token checks, drawn once per process
+uint64_t cursor_token_key;
+pthread_once_t cursor_token_key_once = PTHREAD_ONCE_INIT;
+
+// Function to draw the page token key, falling back to the clock and the
+// process id when the kernel has no random source
+void cursorTokenKeyCreate(void)
+{
+    if (syscall(SYS_getrandom, &cursor_token_key, sizeof(cursor_token_key), 0) != sizeof(cursor_token_key))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        cursor_token_key = mix64((uint64_t)now.tv_sec << 32 ^ (uint64_t)now.tv_nsec ^ (uint64_t)getpid() << 48);
+    }
+}
+
+// Function to compute the keyed check of a page token's bytes
+uint64_t cursorTokenCheck(const unsigned char *bytes, int size)
+{
+    pthread_once(&cursor_token_key_once, cursorTokenKeyCreate);
+    uint64_t h = cursor_token_key;
+    
+    for (int i = 0; i < size; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i < 8 ? size - i : 8);
+        h = mix64(h ^ word) + cursor_token_key;
+    }
+    return mix64(h ^ (uint64_t)size);
+}
+
+// Function to compare a row of a snapshot with a cursor position in the
+// position's order; the start position (row -1) sorts before every row
+int cursorCompare(const struct directory_table *table, int row, const struct cursor_position *position)
+{
+    if (position->row < 0)
+    {
+        return 1;
+    }
+    
+    uint64_t number = tableNumber(table, row);
+    int result = 0;
+    if (position->order == LOOKUP_BY_NAME)
+    {
+        result = tableCompareName(table, row, position->name, position->name_length,
+                                  namePrefix(position->name, position->name_length));
+    }
+    if (result == 0 && position->order != CURSOR_BY_ROW)
+    {
+        result = (number > position->number) - (number < position->number);
+    }
+    return result ? result : (row > position->row) - (row < position->row);
+}
+
+// Function to open a cursor in storage, name or number order, at the start
+// or after the position saved in a token; returns -1 for a bad token
+int directoryCursorOpen(struct directory_cursor *cursor, int order, const char *token)
+{
+    unsigned char bytes[CURSOR_TOKEN_BYTES];
+    int size = 0;
+    
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->after.order = order;
+    cursor->after.row = -1;
+    if (token != NULL && strcmp(token, "-") != 0)
+    {
+        // Tokens are hex: order, row, number, name length, name, keyed check
+        for (; token[2 * size] != '\0' && size < CURSOR_TOKEN_BYTES; size++)
+        {
+            int high = hexValue(token[2 * size]);
+            int low = high < 0 ? -1 : hexValue(token[2 * size + 1]);
+            if (low < 0)
+            {
+                return -1;
+            }
+            bytes[size] = high << 4 | low;
+        }
+        uint64_t check;
+        if (token[2 * size] != '\0' || size < 22 || size != 22 + bytes[13] ||
+            bytes[0] != order)
+        {
+            return -1;
+        }
+        memcpy(&check, bytes + size - 8, 8);
+        if (check != cursorTokenCheck(bytes, size - 8))
+        {
+            return -1;
+        }
+        memcpy(&cursor->after.row, bytes + 1, 4);
+        memcpy(&cursor->after.number, bytes + 5, 8);
+        cursor->after.name_length = bytes[13];
+        memcpy(cursor->after.name, bytes + 14, bytes[13]);
+        if (cursor->after.row < -1)
+        {
+            return -1;
+        }
+    }
+    
+    if (order != CURSOR_BY_ROW)
+    {
+        cursor->index = directorySortedIndex(order);
+        if (cursor->index == NULL)
+        {
+            return -1;
+        }
+        __atomic_add_fetch(&cursor->index->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    if (tableSnapshot(&directory, &cursor->snapshot) != 0)
+    {
+        sortedIndexRelease(cursor->index);
+        return -1;
+    }
+    
+    // Rows are never reused, so a token row past the table was not issued
+    // by this directory
+    if (cursor->after.row >= cursor->snapshot.count)
+    {
+        tableFree(&cursor->snapshot);
+        sortedIndexRelease(cursor->index);
+        return -1;
+    }
+    
+    // Seek to the first record after the saved position
+    if (order == CURSOR_BY_ROW)
+    {
+        cursor->next = cursor->after.row + 1;
+    }
+    else
+    {
+        int low = 0;
+        int high = cursor->index->count;
+        while (low < high)
+        {
+            int middle = low + (high - low) / 2;
+            if (cursorCompare(&cursor->snapshot, cursor->index->rows[middle], &cursor->after) > 0)
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        cursor->next = low;
+    }
+    return 0;
+}
+
+// Function to fill records with the next batch of up to max entries;
+// returns the number filled, 0 at the end. The records stay valid until
+// the cursor is closed.
+int directoryCursorNext(struct directory_cursor *cursor, struct directory_record *records, int max)
+{
+    const struct directory_table *table = &cursor->snapshot;
+    int filled = 0;
+    
+    while (filled < max)
+    {
+        int row = -1;
+        if (cursor->index != NULL)
+        {
+            if (cursor->next >= cursor->index->count)
+            {
+                break;
+            }
+            row = cursor->index->rows[cursor->next++];
+        }
+        else
+        {
+            // Skip whole words of deleted rows at a time
+            while (cursor->next < table->count)
+            {
+                uint64_t mask = tableLiveWord(table, cursor->next / 64) >> (cursor->next % 64);
+                if (mask != 0)
+                {
+                    row = cursor->next + __builtin_ctzll(mask);
+                    break;
+                }
+                cursor->next = (cursor->next / 64 + 1) * 64;
+            }
+            if (row < 0 || row >= table->count)
+            {
+                cursor->next = table->count;
+                break;
+            }
+            cursor->next = row + 1;
+        }
+    
+        records[filled].row = row;
+        records[filled].name_length = tableNameLength(table, row);
+        records[filled].name = tableNamePointer(table, row);
+        records[filled].number = tableNumber(table, row);
+        records[filled].version = tableVersion(table, row);
+        filled++;
+    }
+    
+    if (filled > 0)
+    {
+        const struct directory_record *last = &records[filled - 1];
+        cursor->after.row = last->row;
+        cursor->after.number = last->number;
+        cursor->after.name_length = cursor->after.order == LOOKUP_BY_NAME ? last->name_length : 0;
+        memcpy(cursor->after.name, last->name, cursor->after.name_length);
+    }
+    return filled;
+}
+
+// Function to write the token that resumes after the last record returned
+void directoryCursorToken(const struct directory_cursor *cursor, char *token)
+{
+    unsigned char bytes[CURSOR_TOKEN_BYTES];
+    int size = 14 + cursor->after.name_length;
+    
+    bytes[0] = cursor->after.order;
+    memcpy(bytes + 1, &cursor->after.row, 4);
+    memcpy(bytes + 5, &cursor->after.number, 8);
+    bytes[13] = cursor->after.name_length;
+    memcpy(bytes + 14, cursor->after.name, cursor->after.name_length);
+    uint64_t check = cursorTokenCheck(bytes, size);
+    memcpy(bytes + size, &check, 8);
+    size += 8;
+    
+    for (int i = 0; i < size; i++)
+    {
+        sprintf(token + 2 * i, "%02x", bytes[i]);
+    }
+    token[2 * size] = '\0';
+}
+
+// Function to release the snapshot and index pinned by a cursor
+void directoryCursorClose(struct directory_cursor *cursor)
+{
+    tableFree(&cursor->snapshot);
+    sortedIndexRelease(cursor->index);
+    cursor->index = NULL;
+}
+
+// Function to list a page of entries in name, number or storage order,
+// starting at the beginning or from the token printed by the previous page
+void listEntries()
+{
+    int order;
+    int limit;
+    char token[CURSOR_TOKEN_SIZE];
+    struct directory_cursor cursor;
+    struct directory_record records[CURSOR_BATCH];
+    uint64_t numbers[CURSOR_BATCH];
+    char texts[CURSOR_BATCH][NUMBER_TEXT_SIZE];
+    
+    printf("Sort by (1) name, (2) number or (3) storage order: ");
+    scanf("%d", &order);
+    printf("Enter the number of entries: ");
+    scanf("%d", &limit);
+    printf("Enter the page token (- to start): ");
+    scanf(" %554s", token);
+    
+    order = order == 2 ? LOOKUP_BY_NUMBER : order == 3 ? CURSOR_BY_ROW : LOOKUP_BY_NAME;
+    if (directoryCursorOpen(&cursor, order, token) != 0)
+    {
+        printf("Invalid page token.\n");
+        return;
+    }
+    
+    int listed = 0;
+    while (listed < limit)
+    {
+        int count = directoryCursorNext(&cursor, records, limit - listed < CURSOR_BATCH ? limit - listed : CURSOR_BATCH);
+        if (count == 0)
+        {
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            numbers[i] = records[i].number;
+        }
+        formatNumbers(numbers, texts, count);
+        for (int i = 0; i < count; i++)
+        {
+            printf("Entry %d: %-20.*s %s\n", tableEntryForRow(&cursor.snapshot, records[i].row),
+                   records[i].name_length, records[i].name, texts[i]);
+        }
+        listed += count;
+    }
+    
+    if (listed > 0 && listed == limit)
+    {
+        directoryCursorToken(&cursor, token);
+        printf("Listed %d entries. Next page token: %s\n", listed, token);
+    }
+    else
+    {
+        printf("Listed %d entries. End of the listing.\n", listed);
+    }
+    directoryCursorClose(&cursor);
+}
+
+// Function to print statistics about the in-memory directory
+void showStatistics()
+{
+    printf("Entries: %d (%d rows, %d deleted)\n", directory.live_count, directory.count,
+           directory.count - directory.live_count);
+    printf("Name arena: %d pages, %u bytes\n", directory.names.page_count, directory.names.used);
+    printf("Bloom filter: %u blocks, %d hashes, %llu numbers added\n", bloom.block_count, BLOOM_HASHES,
+           (unsigned long long)bloom.entries);
+    printf("Bloom false-positive rate: %.6f\n", bloomFalsePositiveRate(&bloom));
+    printf("Number lookups answered by the Bloom filter: %llu\n", (unsigned long long)bloom_negatives);
+    printf("Lookup cache: %llu hits, %llu misses, %llu admitted, %llu rejected\n",
+           (unsigned long long)lookup_cache.hits, (unsigned long long)lookup_cache.misses,
+           (unsigned long long)lookup_cache.admitted, (unsigned long long)lookup_cache.rejected);
+    pthread_mutex_lock(&changes.lock);
+    printf("Change feed: next sequence %llu, %llu changes waiting for the log\n",
+           (unsigned long long)changes.next_sequence, (unsigned long long)(changes.next_sequence - changes.written));
+    pthread_mutex_unlock(&changes.lock);
+    
+    if (shard_count > 0)
+    {
+        printf("Shards: %d\n", shard_count);
+        printf("I/O backend: %s\n", __atomic_load_n(&io_backend, __ATOMIC_RELAXED));
+        uint64_t hits;
+        uint64_t misses;
+        size_t bytes;
+        blockCacheTotals(&block_cache, &hits, &misses, &bytes);
+        printf("Block cache: %zu of %zu bytes, %llu hits, %llu misses\n", bytes,
+               block_cache.shard_budget * BLOCK_CACHE_SHARDS, (unsigned long long)hits, (unsigned long long)misses);
+    }
+}
+
+// Function to publish the deletion of a row to the change feed
+void emitDelete(int row)
+{
+    char name[MAX_NAME_LENGTH + 1];
+    
+    tableName(&directory, row, name);
+    changeEmit(&changes, CHANGE_DELETE, "", 0, name, tableNumber(&directory, row), 0);
+}
+
+// Function to delete an entry from the telephone directory
+void deleteEntry()
+{
+    int entrynumber;
+    
+    if (num > 0)
+    {
+        printf("Give the entry number n-%d...\n",num);
+    }
+    
+    printf("Enter entry number to delete: ");
+    scanf("%d", &entrynumber);
+    entrynumber += 1;
+    fflush(stdin);
+    
+    int row = tableRowForEntry(&directory, entrynumber - 1);
+    if (row < 0)
+    {
+        printf("No such entry.\n");
+        return;
+    }
+    
+    if (shard_count > 0)
+    {
+        // Deletes are tombstones in the engine; the text file is rewritten on exit
+        if (compareAndDelete(row, tableVersion(&directory, row)) != 0)
+        {
+            printf("Unable to delete the entry.\n");
+            return;
+        }
+        printf("Entry deleted successfully.\n");
+        num++;
+        return;
+    }
+    
+    FILE *file = fopen("telephone_directory.txt", "r");
+    if (file == NULL)
+    {
+        printf("Unable to open the file.");
+        return;
+    }
+    
+    // Nothing changes in memory unless the file was rewritten
+    if (RemoveLineFromFile(file, entrynumber) != 0)
+    {
+        printf("Unable to delete the entry.\n");
+        return;
+    }
+    
+    emitDelete(row);
+    lookupCacheInvalidateRow(&lookup_cache, &directory, row);
+    tableDelete(&directory, row);
+    
+    // The rewrite above is our compaction point: drop deleted numbers
+    bloomRebuild(&bloom, &directory);
+    
+    num++;
+}
+
+// Function to compile a directory file into a read-only snapshot
+int compileCommand(const char *source, const char *output)
+{
+    struct directory_table table = {0};
+    FILE *file = fopen(source, "r");
+    
+    if (file == NULL)
+    {
+        printf("Unable to open the file.");
+        return 1;
+    }
+    
+    int loaded = tableLoad(&table, file);
+    fclose(file);
+    if (loaded < 0 || compileSnapshot(&table, output) != 0)
+    {
+        printf("Unable to compile the directory.\n");
+        tableFree(&table);
+        return 1;
+    }
+    
+    printf("Compiled %d entries into %s\n", loaded, output);
+    tableFree(&table);
+    return 0;
+}
+
+// Hash index from a name and number to the rows holding them, so a
+// follower finds the old row of an update or delete without a scan. Rows
+// are only ever added to it: entries for rows that were deleted or changed
+// since are skipped on lookup, and the index is rebuilt from the live rows
+// whenever it fills up, which keeps its size within twice the live rows.
+struct row_index_node
+{
+    int row;
+    int next;
+};
+
+struct row_index
+{
+    int *heads;
+    struct row_index_node *nodes;
+    int bucket_count;
+    int node_count;
+};
+
+// Function to hash a name and packed number into a bucket of the index
+int rowIndexBucket(const struct row_index *index, const char *name, int len, uint64_t number)
+{
+    return mix64(hashName(name, len) ^ number) & (index->bucket_count - 1);
+}
+
+// Function to release the buckets and nodes of an index
+void rowIndexFree(struct row_index *index)
+{
+    free(index->heads);
+    free(index->nodes);
+    memset(index, 0, sizeof(*index));
+}
+
+// Function to add a row to the index without checking for room
+void rowIndexLink(struct row_index *index, const struct directory_table *table, int row)
+{
+    int bucket = rowIndexBucket(index, tableNamePointer(table, row), tableNameLength(table, row),
+                                tableNumber(table, row));
+    index->nodes[index->node_count].row = row;
+    index->nodes[index->node_count].next = index->heads[bucket];
+    index->heads[bucket] = index->node_count++;
+}
+
+// Function to rebuild the index from the live rows of a table; on failure
+// the index is left empty and lookups fall back to a scan
+int rowIndexRebuild(struct row_index *index, const struct directory_table *table)
+{
+    int buckets = 64;
+    
+    while (buckets < 2 * (table->live_count + 1))
+    {
+        buckets *= 2;
+    }
+    rowIndexFree(index);
+    index->heads = malloc(buckets * sizeof(int));
+    index->nodes = malloc(buckets * sizeof(struct row_index_node));
+    if (index->heads == NULL || index->nodes == NULL)
+    {
+        rowIndexFree(index);
+        return -1;
+    }
+    index->bucket_count = buckets;
+    memset(index->heads, -1, buckets * sizeof(int));
+    
+    for (int word = 0; word * 64 < table->count; word++)
+    {
+        uint64_t mask = tableLiveWord(table, word);
+        while (mask)
+        {
+            rowIndexLink(index, table, word * 64 + __builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+    }
+    return 0;
+}
+
+// Function to add a row under its current name and number
+void rowIndexAdd(struct row_index *index, const struct directory_table *table, int row)
+{
+    if (index->node_count == index->bucket_count)
+    {
+        // A rebuild picks up the new row along with the others
+        rowIndexRebuild(index, table);
+        return;
+    }
+    rowIndexLink(index, table, row);
+}
+
+// Log-shipping replication. A follower tails the leader's change log,
+// applies each batch to its own copy of the directory and then rewrites
+// its directory file from a snapshot, so reads never wait for the file.
+// A follower always starts from the beginning of the log; the leader's
+// clear records reset it along the way.
+struct follower
+{
+    char log_name[FILENAME_SIZE];
+    char directory_name[FILENAME_SIZE];
+    off_t offset;
+    uint64_t applied;
+    uint64_t applied_time_ms;
+    uint64_t apply_lag_ms;
+    uint64_t batches;
+    uint64_t diverged;
+    uint64_t diverged_sequence;
+    int modified;
+    struct row_index rows;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int stopping;
+};
+
+// Function to check whether a row is live and holds a name and packed number
+int followerRowMatches(const struct directory_table *table, int row, const char *name, int len, uint64_t number)
+{
+    return tableNumber(table, row) == number && tableIsLive(table, row) && tableNameLength(table, row) == len &&
+           memcmp(tableNamePointer(table, row), name, len) == 0;
+}
+
+// Function to find the live row holding a name and packed number through
+// the follower's index, or by a scan when the index could not be built
+int followerFindRow(const struct follower *follower, const struct directory_table *table, const char *name, int len,
+                    uint64_t number)
+{
+    const struct row_index *index = &follower->rows;
+    
+    if (index->heads == NULL)
+    {
+        for (int row = 0; row < table->count; row++)
+        {
+            if (followerRowMatches(table, row, name, len, number))
+            {
+                return row;
+            }
+        }
+        return -1;
+    }
+    
+    for (int node = index->heads[rowIndexBucket(index, name, len, number)]; node >= 0; node = index->nodes[node].next)
+    {
+        if (followerRowMatches(table, index->nodes[node].row, name, len, number))
+        {
+            return index->nodes[node].row;
+        }
+    }
+    return -1;
+}
+
+// Function to apply a batch of changes to the follower's table. An update
+// or delete whose old entry is missing means the copy has diverged from
+// the leader; it is counted rather than applied.
+int followerApply(const struct change_header **batch, int count, void *context)
+{
+    struct follower *follower = context;
+    char name[MAX_NAME_LENGTH + 1];
+    
+    pthread_mutex_lock(&follower->lock);
+    for (int i = 0; i < count; i++)
+    {
+        const struct change_header *header = batch[i];
+        int row = -1;
+    
+        if (header->op == CHANGE_UPDATE || header->op == CHANGE_DELETE)
+        {
+            row = followerFindRow(follower, &directory, changeOldName(header), header->old_name_length,
+                                  header->old_number);
+        }
+        memcpy(name, changeName(header), header->name_length);
+        name[header->name_length] = '\0';
+    
+        if (header->op == CHANGE_CLEAR)
+        {
+            tableFree(&directory);
+            memset(&directory, 0, sizeof(directory));
+            rowIndexFree(&follower->rows);
+            follower->modified = 1;
+        }
+        else if (header->op == CHANGE_INSERT)
+        {
+            row = tableAppend(&directory, name, header->number);
+            if (row >= 0)
+            {
+                rowIndexAdd(&follower->rows, &directory, row);
+                follower->modified = 1;
+            }
+        }
+        else if (row < 0)
+        {
+            follower->diverged++;
+            follower->diverged_sequence = header->sequence;
+        }
+        else if (header->op == CHANGE_UPDATE)
+        {
+            if (tableUpdate(&directory, row, name, header->number) == 0)
+            {
+                rowIndexAdd(&follower->rows, &directory, row);
+                follower->modified = 1;
+            }
+        }
+        else if (header->op == CHANGE_DELETE)
+        {
+            tableDelete(&directory, row);
+            follower->modified = 1;
+        }
+        follower->applied = header->sequence;
+        follower->applied_time_ms = header->time_ms;
+    }
+    follower->apply_lag_ms = changeTimeMs() - follower->applied_time_ms;
+    follower->batches++;
+    pthread_mutex_unlock(&follower->lock);
+    return 0;
+}
+
+// Function to apply whatever the leader logged since the last poll and
+// rewrite the follower's directory file if the copy changed; returns the
+// changes read or -1
+int followerPoll(struct follower *follower)
+{
+    struct directory_table snapshot;
+    struct atomic_file replace;
+    
+    int applied = changeLogRead(follower->log_name, 0, &follower->offset, followerApply, follower);
+    if (applied <= 0)
+    {
+        return applied;
+    }
+    
+    pthread_mutex_lock(&follower->lock);
+    int modified = follower->modified;
+    int pinned = modified ? tableSnapshot(&directory, &snapshot) : 0;
+    follower->modified = 0;
+    pthread_mutex_unlock(&follower->lock);
+    if (!modified)
+    {
+        return applied;
+    }
+    if (pinned != 0)
+    {
+        return -1;
+    }
+    if (atomicOpen(&replace, follower->directory_name, "w") == NULL)
+    {
+        tableFree(&snapshot);
+        return -1;
+    }
+    tableExport(&snapshot, replace.file);
+    tableFree(&snapshot);
+    return atomicCommit(&replace) == 0 ? applied : -1;
+}
+
+// Function run by the replication thread
+void *followerWorker(void *argument)
+{
+    struct follower *follower = argument;
+    
+    while (1)
+    {
+        pthread_mutex_lock(&follower->lock);
+        int stopping = follower->stopping;
+        pthread_mutex_unlock(&follower->lock);
+        if (stopping)
+        {
+            return NULL;
+        }
+    
+        if (followerPoll(follower) <= 0)
+        {
+            usleep(CHANGE_POLL_MS * 1000);
+        }
+    }
+}
+
+// Function to note the oldest change a follower has not applied yet
+int countPending(const struct change_header **batch, int count, void *context)
+{
+    uint64_t *pending = context;
+    
+    if (pending[0] == 0)
+    {
+        pending[1] = batch[0]->time_ms;
+    }
+    pending[0] += count;
+    return 0;
+}
+
+// Function to print how far a follower is behind its leader
+void followerStatus(struct follower *follower)
+{
+    uint64_t pending[2] = {0, 0};
+    
+    pthread_mutex_lock(&follower->lock);
+    off_t offset = follower->offset;
+    uint64_t applied = follower->applied;
+    uint64_t apply_lag_ms = follower->apply_lag_ms;
+    uint64_t batches = follower->batches;
+    uint64_t diverged = follower->diverged;
+    uint64_t diverged_sequence = follower->diverged_sequence;
+    int live = directory.live_count;
+    pthread_mutex_unlock(&follower->lock);
+    
+    changeLogRead(follower->log_name, 0, &offset, countPending, pending);
+    printf("Applied through sequence %llu (%d entries, %llu batches)\n", (unsigned long long)applied, live,
+           (unsigned long long)batches);
+    printf("Replication lag: %llu entries, %llu ms\n", (unsigned long long)pending[0],
+           (unsigned long long)(pending[0] ? changeTimeMs() - pending[1] : 0));
+    printf("Last batch applied %llu ms after it was logged\n", (unsigned long long)apply_lag_ms);
+    if (diverged > 0)
+    {
+        printf("Diverged from the leader: %llu changes had no matching entry, the last at sequence %llu\n",
+               (unsigned long long)diverged, (unsigned long long)diverged_sequence);
+    }
+}
+
+// Function to search the follower's copy by name or number
+void followerSearch(struct follower *follower, int by_number)
+{
+    char value[MAX_NAME_LENGTH + 1];
+    int rows[LOOKUP_MAX_ROWS];
+    int found = 0;
+    
+    printf(by_number ? "Enter the phoneNumber to search: " : "Enter the Name to search: ");
+    scanf(" %255[^\n]", value);
+    
+    pthread_mutex_lock(&follower->lock);
+    if (!by_number)
+    {
+        found = tableFindName(&directory, value, rows, LOOKUP_MAX_ROWS, tablePrintRow);
+    }
+    else
+    {
+        uint64_t packed;
+        if (normalizeNumber(value, &packed) == 0)
+        {
+            found = tableFindNumber(&directory, packed, rows, LOOKUP_MAX_ROWS, tablePrintRow);
+        }
+    }
+    pthread_mutex_unlock(&follower->lock);
+    
+    if (found == 0)
+    {
+        printf("No entry found.\n");
+    }
+}
+
+// Function to run a read-only follower of a leader's change log
+int followCommand(const char *log_name, const char *directory_name)
+{
+    struct follower follower;
+    int choice;
+    
+    memset(&follower, 0, sizeof(follower));
+    if (strlen(log_name) >= FILENAME_SIZE || strlen(directory_name) >= FILENAME_SIZE)
+    {
+        printf("The file name is too long.\n");
+        return 1;
+    }
+    strcpy(follower.log_name, log_name);
+    strcpy(follower.directory_name, directory_name);
+    pthread_mutex_init(&follower.lock, NULL);
+    
+    if (followerPoll(&follower) < 0 || pthread_create(&follower.thread, NULL, followerWorker, &follower) != 0)
+    {
+        printf("Unable to start the follower.\n");
+        return 1;
+    }
+    printf("Following %s into %s.\n", log_name, directory_name);
+    
+    while (1)
+    {
+        printf("Follower Menu:\n");
+        printf("1. Search by name\n");
+        printf("2. Search by number\n");
+        printf("3. Show replication status\n");
+        printf("4. Exit\n");
+        printf("Enter your choice: ");
+        if (scanf("%d", &choice) != 1)
+        {
+            choice = 4;
+        }
+    
+        switch (choice)
+        {
+            case 1:
+                followerSearch(&follower, 0);
+                break;
+            case 2:
+                followerSearch(&follower, 1);
+                break;
+            case 3:
+                followerStatus(&follower);
+                break;
+            case 4:
+                pthread_mutex_lock(&follower.lock);
+                follower.stopping = 1;
+                pthread_mutex_unlock(&follower.lock);
+                pthread_join(follower.thread, NULL);
+                tableFree(&directory);
+                rowIndexFree(&follower.rows);
+                printf("Exiting...\n");
+                return 0;
+            default:
+                printf("Invalid operation.\n");
+        }
+    
+        printf("\n");
+    }
+}
+
+// Incremental backups. The change log already records every mutation, so
+// a backup only copies the changes logged since the previous one into a
+// new segment named after its first sequence number; the cost grows with
+// churn, not with the size of the directory. A restore replays the
+// segments in order, stopping at a chosen sequence number or time.
+//
+// The backup state is the last sequence number backed up plus the identity
+// of the log file it came from. The byte offset next to them is only a
+// hint: when the log is another file or shorter than the offset, it is
+// scanned from the start, and a log that no longer continues from the
+// saved sequence is refused rather than silently backed up out of order.
+struct backup_job
+{
+    const char *directory;
+    uint64_t after;
+    uint64_t first;
+    uint64_t last;
+    uint64_t newest;
+    int opened;
+    int failed;
+    struct atomic_file replace;
+};
+
+// Function to copy the changes after the last backup into the segment,
+// creating it at the first one
+int backupWrite(const struct change_header **batch, int count, void *context)
+{
+    struct backup_job *job = context;
+    char segment_name[FILENAME_SIZE];
+    
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t sequence = batch[i]->sequence;
+        job->newest = sequence > job->newest ? sequence : job->newest;
+        if (sequence <= job->after)
+        {
+            continue;
+        }
+        if (!job->opened)
+        {
+            // Segment names sort in sequence order
+            snprintf(segment_name, sizeof(segment_name), "%s/changes.%020llu", job->directory,
+                     (unsigned long long)sequence);
+            if (atomicOpen(&job->replace, segment_name, "wb") == NULL)
+            {
+                job->failed = 1;
+                return -1;
+            }
+            job->opened = 1;
+            job->first = sequence;
+        }
+        fwrite(batch[i], 1, changeSize(batch[i]), job->replace.file);
+        job->last = sequence;
+    }
+    return 0;
+}
+
+// Function to copy the changes logged since the last backup into a new
+// segment of a backup directory
+int backupCommand(const char *backup_directory)
+{
+    char state_name[FILENAME_SIZE];
+    char line[MAX_LINE];
+    struct backup_job job;
+    struct atomic_file replace;
+    struct stat info;
+    unsigned long long device = 0;
+    unsigned long long inode = 0;
+    unsigned long long value;
+    long long start = 0;
+    
+    memset(&job, 0, sizeof(job));
+    job.directory = backup_directory;
+    if (snprintf(state_name, sizeof(state_name), "%s/backup.state", backup_directory) >= (int)sizeof(state_name))
+    {
+        printf("The file name is too long.\n");
+        return 1;
+    }
+    mkdir(backup_directory, 0755);
+    FILE *state = fopen(state_name, "r");
+    if (state != NULL)
+    {
+        while (fgets(line, MAX_LINE, state) != NULL)
+        {
+            if (sscanf(line, "sequence %llu", &value) == 1)
+            {
+                job.after = value;
+            }
+            else if (sscanf(line, "device %llu", &value) == 1)
+            {
+                device = value;
+            }
+            else if (sscanf(line, "inode %llu", &value) == 1)
+            {
+                inode = value;
+            }
+            else if (sscanf(line, "offset %llu", &value) == 1)
+            {
+                start = value;
+            }
+        }
+        fclose(state);
+    }
+    
+    if (stat(CHANGE_LOG_FILENAME, &info) != 0)
+    {
+        printf("No changes since the last backup.\n");
+        return 0;
+    }
+    int rescan = (unsigned long long)info.st_dev != device || (unsigned long long)info.st_ino != inode ||
+                 info.st_size < start;
+    if (rescan)
+    {
+        start = 0;
+    }
+    
+    off_t end = start;
+    if (changeLogRead(CHANGE_LOG_FILENAME, 0, &end, backupWrite, &job) < 0)
+    {
+        if (job.opened)
+        {
+            atomicAbort(&job.replace);
+        }
+        printf(job.failed ? "Unable to create the backup.\n" : "Unable to read the change log.\n");
+        return 1;
+    }
+    
+    // The first new change must follow the last one backed up, and a log
+    // read from the start must reach it
+    if (job.after > 0 && ((job.first != 0 && job.first != job.after + 1) || (rescan && job.newest < job.after)))
+    {
+        if (job.opened)
+        {
+            atomicAbort(&job.replace);
+        }
+        printf("The change log no longer continues from sequence %llu; it was reset or truncated. Start a new "
+               "backup directory.\n", (unsigned long long)job.after);
+        return 1;
+    }
+    
+    // The segment is durable before the state moves past it; a crash in
+    // between just writes the same segment again next time
+    if (job.opened && atomicCommit(&job.replace) != 0)
+    {
+        printf("Unable to create the backup.\n");
+        return 1;
+    }
+    if (atomicOpen(&replace, state_name, "w") == NULL)
+    {
+        printf("Unable to create the backup.\n");
+        return 1;
+    }
+    fprintf(replace.file, "sequence %llu\ndevice %llu\ninode %llu\noffset %lld\n",
+            (unsigned long long)(job.opened ? job.last : job.after), (unsigned long long)info.st_dev,
+            (unsigned long long)info.st_ino, (long long)end);
+    if (atomicCommit(&replace) != 0)
+    {
+        printf("Unable to create the backup.\n");
+        return 1;
+    }
+    if (!job.opened)
+    {
+        printf("No changes since the last backup.\n");
+        return 0;
+    }
+    printf("Backed up changes %llu to %llu.\n", (unsigned long long)job.first, (unsigned long long)job.last);
+    return 0;
+}
+
+// Replay state of a restore: the changes past the target are skipped,
+// and once the target is reached nothing after it is applied
+struct restore_job
+{
+    struct follower replica;
+    uint64_t last_sequence;
+    uint64_t last_time_ms;
+    int reached;
+};
+
+// Function to apply the transactions of a batch that end before the
+// restore target. A transaction the target falls inside is dropped whole.
+int restoreApply(const struct change_header **batch, int count, void *context)
+{
+    struct restore_job *job = context;
+    int keep = 0;
+    
+    for (int i = 0; i < count && !job->reached; i++)
+    {
+        if (batch[i]->sequence > job->last_sequence || batch[i]->time_ms > job->last_time_ms)
+        {
+            job->reached = 1;
+        }
+        else if (!(batch[i]->flags & CHANGE_CONTINUED))
+        {
+            keep = i + 1;
+        }
+    }
+    return keep > 0 ? followerApply(batch, keep, &job->replica) : 0;
+}
+
+// Function to compare segment names for sorting
+int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to rebuild a directory file from a backup as of a sequence
+// number, or a time in milliseconds when the target starts with '@'
+int restoreCommand(const char *backup_directory, const char *output, const char *target)
+{
+    struct restore_job job;
+    struct atomic_file replace;
+    char segment_name[FILENAME_SIZE];
+    char **names = NULL;
+    int name_count = 0;
+    int result = 1;
+    
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.replica.lock, NULL);
+    job.last_sequence = UINT64_MAX;
+    job.last_time_ms = UINT64_MAX;
+    if (target != NULL && target[0] == '@')
+    {
+        job.last_time_ms = strtoull(target + 1, NULL, 10);
+    }
+    else if (target != NULL)
+    {
+        job.last_sequence = strtoull(target, NULL, 10);
+    }
+    
+    DIR *listing = opendir(backup_directory);
+    if (listing == NULL)
+    {
+        printf("Unable to open the backup.\n");
+        return 1;
+    }
+    struct dirent *item;
+    while ((item = readdir(listing)) != NULL)
+    {
+        if (strncmp(item->d_name, "changes.", 8) != 0 || strchr(item->d_name + 8, '.') != NULL)
+        {
+            continue;
+        }
+        char **grown = realloc(names, (name_count + 1) * sizeof(char *));
+        if (grown == NULL || (grown[name_count] = strdup(item->d_name)) == NULL)
+        {
+            names = grown ? grown : names;
+            closedir(listing);
+            goto done;
+        }
+        names = grown;
+        name_count++;
+    }
+    closedir(listing);
+    qsort(names, name_count, sizeof(char *), compareNames);
+    
+    for (int i = 0; i < name_count; i++)
+    {
+        off_t offset = 0;
+        snprintf(segment_name, sizeof(segment_name), "%s/%s", backup_directory, names[i]);
+        if (changeLogRead(segment_name, 0, &offset, restoreApply, &job) < 0)
+        {
+            printf("Unable to read %s.\n", segment_name);
+            goto done;
+        }
+    }
+    
+    if (atomicOpen(&replace, output, "w") == NULL)
+    {
+        printf("Unable to create the file.");
+        goto done;
+    }
+    tableExport(&directory, replace.file);
+    if (atomicCommit(&replace) == 0)
+    {
+        printf("Restored %d entries as of sequence %llu.\n", directory.live_count,
+               (unsigned long long)job.replica.applied);
+        result = 0;
+    }
+    
+done:
+    for (int i = 0; i < name_count; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    tableFree(&directory);
+    rowIndexFree(&job.replica.rows);
+    return result;
+}
+
+// External merge sort of a directory file within a memory budget. The
+// input is cut into buffers of whole records; each full buffer is sorted
+// and written out as a run by its own thread while the next one fills.
+// The runs are then merged with a loser tree, SORT_MAX_FANIN at a time,
+// and the last merge writes the sorted directory file. Run records are
+// the packed number, the name length and the name.
+struct sort_buffer
+{
+    unsigned char *data;
+    size_t used;
+    size_t capacity;
+    unsigned char **records;
+    int count;
+    int field;
+    char run_name[FILENAME_SIZE];
+    int result;
+    pthread_t thread;
+    int busy;
+};
+
+// Merge input: the current record of one run, of a directory file when
+// text is set, or of an in-memory array of sorted records
+struct sort_cursor
+{
+    FILE *file;
+    int text;
+    unsigned char **records;
+    int count;
+    int next;
+    int done;
+    uint64_t number;
+    int name_length;
+    char name[MAX_NAME_LENGTH];
+};
+
+// Function to compare two entries by name, then number, or the other way
+// round; returns <0, 0 or >0
+int sortCompare(int field, const char *name_a, int len_a, uint64_t number_a, const char *name_b, int len_b,
+                uint64_t number_b)
+{
+    int by_name = memcmp(name_a, name_b, len_a < len_b ? len_a : len_b);
+    by_name = by_name ? by_name : len_a - len_b;
+    int by_number = (number_a > number_b) - (number_a < number_b);
+    
+    if (field == LOOKUP_BY_NUMBER)
+    {
+        return by_number ? by_number : by_name;
+    }
+    return by_name ? by_name : by_number;
+}
+
+// Function to compare two records of a sort buffer, for qsort
+int compareRecordsByName(const void *a, const void *b)
+{
+    const unsigned char *ra = *(unsigned char *const *)a;
+    const unsigned char *rb = *(unsigned char *const *)b;
+    uint64_t na;
+    uint64_t nb;
+    
+    memcpy(&na, ra, 8);
+    memcpy(&nb, rb, 8);
+    return sortCompare(LOOKUP_BY_NAME, (const char *)ra + 9, ra[8], na, (const char *)rb + 9, rb[8], nb);
+}
+
+// Function to compare two records of a sort buffer by number, for qsort
+int compareRecordsByNumber(const void *a, const void *b)
+{
+    const unsigned char *ra = *(unsigned char *const *)a;
+    const unsigned char *rb = *(unsigned char *const *)b;
+    uint64_t na;
+    uint64_t nb;
+    
+    memcpy(&na, ra, 8);
+    memcpy(&nb, rb, 8);
+    return sortCompare(LOOKUP_BY_NUMBER, (const char *)ra + 9, ra[8], na, (const char *)rb + 9, rb[8], nb);
+}
+
+// Function run by a run generation thread: sort a buffer and write it out
+void *sortRunWorker(void *argument)
+{
+    struct sort_buffer *buffer = argument;
+    
+    qsort(buffer->records, buffer->count, sizeof(unsigned char *),
+          buffer->field == LOOKUP_BY_NUMBER ? compareRecordsByNumber : compareRecordsByName);
+    
+    FILE *run = fopen(buffer->run_name, "wb");
+    buffer->result = -1;
+    if (run != NULL)
+    {
+        for (int i = 0; i < buffer->count; i++)
+        {
+            fwrite(buffer->records[i], 1, 9 + buffer->records[i][8], run);
+        }
+        buffer->result = ferror(run) ? -1 : 0;
+        if (fclose(run) != 0)
+        {
+            buffer->result = -1;
+        }
+    }
+    return NULL;
+}
+
+// Function to wait for a buffer's thread and make the buffer reusable
+int sortBufferWait(struct sort_buffer *buffer)
+{
+    if (!buffer->busy)
+    {
+        return 0;
+    }
+    pthread_join(buffer->thread, NULL);
+    buffer->busy = 0;
+    buffer->used = 0;
+    buffer->count = 0;
+    return buffer->result;
+}
+
+// Function to read the next record of a run into its cursor. Malformed
+// lines of a directory file are skipped.
+void sortCursorNext(struct sort_cursor *cursor)
+{
+    unsigned char header[9];
+    
+    if (cursor->records != NULL)
+    {
+        if (cursor->next == cursor->count)
+        {
+            cursor->done = 1;
+            return;
+        }
+        const unsigned char *record = cursor->records[cursor->next++];
+        memcpy(&cursor->number, record, 8);
+        cursor->name_length = record[8];
+        memcpy(cursor->name, record + 9, record[8]);
+        return;
+    }
+    if (cursor->text)
+    {
+        char line[MAX_LINE];
+        char name[MAX_NAME_LENGTH + 1];
+        char number[NUMBER_INPUT_SIZE];
+        while (fgets(line, MAX_LINE, cursor->file) != NULL)
+        {
+            if (parseLine(line, name, number) == 0 && normalizeNumber(number, &cursor->number) == 0)
+            {
+                cursor->name_length = strlen(name);
+                memcpy(cursor->name, name, cursor->name_length);
+                return;
+            }
+        }
+        cursor->done = 1;
+        return;
+    }
+    if (fread(header, 1, 9, cursor->file) != 9 ||
+        fread(cursor->name, 1, header[8], cursor->file) != header[8])
+    {
+        cursor->done = 1;
+        return;
+    }
+    memcpy(&cursor->number, header, 8);
+    cursor->name_length = header[8];
+}
+
+// Loser tree over k cursors. tree[0] holds the index of the smallest
+// current record and tree[1..k-1] the losers of each match, so replacing
+// the winner costs one pass up the tree. Index k is a sentinel smaller
+// than everything, used only while building.
+struct loser_tree
+{
+    int k;
+    int field;
+    int *tree;
+    struct sort_cursor *cursors;
+};
+
+// Function to tell whether cursor a's record sorts before cursor b's
+int loserLess(const struct loser_tree *loser, int a, int b)
+{
+    if (a == loser->k || b == loser->k)
+    {
+        return a == loser->k && b != loser->k;
+    }
+    const struct sort_cursor *ca = &loser->cursors[a];
+    const struct sort_cursor *cb = &loser->cursors[b];
+    if (ca->done || cb->done)
+    {
+        return !ca->done;
+    }
+    int order = sortCompare(loser->field, ca->name, ca->name_length, ca->number, cb->name, cb->name_length, cb->number);
+    return order < 0 || (order == 0 && a < b);
+}
+
+// Function to replay the matches from a leaf up to the root
+void loserAdjust(struct loser_tree *loser, int leaf)
+{
+    int winner = leaf;
+    
+    for (int node = (leaf + loser->k) / 2; node > 0; node /= 2)
+    {
+        if (loserLess(loser, loser->tree[node], winner))
+        {
+            int swap = loser->tree[node];
+            loser->tree[node] = winner;
+            winner = swap;
+        }
+    }
+    loser->tree[0] = winner;
+}
+
+// Function to merge runs into one output: another run, or the final
+// directory file when text is set. The inputs are deleted afterwards.
+int sortMerge(char **run_names, int count, int field, FILE *output, int text)
+{
+    struct loser_tree loser;
+    int result = 0;
+    
+    loser.k = count;
+    loser.field = field;
+    loser.tree = malloc((count + 1) * sizeof(int));
+    loser.cursors = calloc(count + 1, sizeof(struct sort_cursor));
+    if (loser.tree == NULL || loser.cursors == NULL)
+    {
+        free(loser.tree);
+        free(loser.cursors);
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++)
+    {
+        loser.cursors[i].file = fopen(run_names[i], "rb");
+        if (loser.cursors[i].file == NULL)
+        {
+            loser.cursors[i].done = 1;
+            result = -1;
+            continue;
+        }
+        setvbuf(loser.cursors[i].file, NULL, _IOFBF, SORT_READ_BUFFER);
+        sortCursorNext(&loser.cursors[i]);
+    }
+    for (int i = 0; i <= count; i++)
+    {
+        loser.tree[i] = count;
+    }
+    for (int i = count - 1; i >= 0; i--)
+    {
+        loserAdjust(&loser, i);
+    }
+    
+    while (result == 0 && count > 0 && !loser.cursors[loser.tree[0]].done)
+    {
+        struct sort_cursor *winner = &loser.cursors[loser.tree[0]];
+        if (text)
+        {
+            exportLine(output, winner->name, winner->name_length, winner->number);
+        }
+        else
+        {
+            unsigned char header[9];
+            memcpy(header, &winner->number, 8);
+            header[8] = winner->name_length;
+            fwrite(header, 1, 9, output);
+            fwrite(winner->name, 1, winner->name_length, output);
+        }
+        sortCursorNext(winner);
+        loserAdjust(&loser, loser.tree[0]);
+    }
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (loser.cursors[i].file != NULL)
+        {
+            fclose(loser.cursors[i].file);
+        }
+        unlink(run_names[i]);
+    }
+    free(loser.tree);
+    free(loser.cursors);
+    return ferror(output) ? -1 : result;
+}
+
+// Function to add a run file name to a list
+int sortAddRun(char ***run_names, int *run_count, const char *name)
+{
+    char **names = realloc(*run_names, (*run_count + 1) * sizeof(char *));
+    
+    if (names == NULL)
+    {
+        return -1;
+    }
+    *run_names = names;
+    names[*run_count] = strdup(name);
+    if (names[*run_count] == NULL)
+    {
+        return -1;
+    }
+    (*run_count)++;
+    return 0;
+}
+
+// Function to sort a directory file by name or number into another file
+// using about memory bytes; stores the number of runs used
+int sortFile(const char *input, const char *output, int field, size_t memory, int *runs)
+{
+    struct sort_buffer buffers[SORT_MAX_THREADS];
+    char line[MAX_LINE];
+    char name[MAX_NAME_LENGTH + 1];
+    char number[NUMBER_INPUT_SIZE];
+    char **run_names = NULL;
+    int run_count = 0;
+    int next_run = 0;
+    int result = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    threads = threads < 1 ? 1 : threads > SORT_MAX_THREADS ? SORT_MAX_THREADS : threads;
+    if (strlen(output) + 32 > FILENAME_SIZE)
+    {
+        printf("The file name is too long.\n");
+        return -1;
+    }
+    FILE *file = fopen(input, "r");
+    if (file == NULL)
+    {
+        printf("Unable to open the file.");
+        return -1;
+    }
+    
+    // Each buffer holds records plus a pointer per record of at most
+    // 9 + MAX_NAME_LENGTH bytes each
+    memset(buffers, 0, sizeof(buffers));
+    size_t share = memory / threads;
+    share = share < SORT_MIN_BUFFER ? SORT_MIN_BUFFER : share;
+    for (int i = 0; i < threads; i++)
+    {
+        buffers[i].capacity = share / 2;
+        buffers[i].data = malloc(buffers[i].capacity);
+        buffers[i].records = malloc(share / 2);
+        buffers[i].field = field;
+        if (buffers[i].data == NULL || buffers[i].records == NULL)
+        {
+            result = -1;
+        }
+    }
+    size_t max_records = share / 2 / sizeof(unsigned char *);
+    
+    // Skip the header line
+    int current = 0;
+    if (fgets(line, MAX_LINE, file) == NULL)
+    {
+        line[0] = '\0';
+    }
+    while (result == 0)
+    {
+        int more = fgets(line, MAX_LINE, file) != NULL;
+        struct sort_buffer *buffer = &buffers[current];
+        uint64_t packed;
+    
+        if (more && (parseLine(line, name, number) != 0 || normalizeNumber(number, &packed) != 0))
+        {
+            printf("Skipping malformed line: %s\n", line);
+            continue;
+        }
+        size_t size = more ? 9 + strlen(name) : 0;
+        if ((!more && buffer->count > 0) || buffer->used + size > buffer->capacity ||
+            (size_t)buffer->count == max_records)
+        {
+            // Hand the full buffer to a thread and fill the next one
+            snprintf(buffer->run_name, sizeof(buffer->run_name), "%s.sort.%d", output, next_run++);
+            if (sortAddRun(&run_names, &run_count, buffer->run_name) != 0 ||
+                pthread_create(&buffer->thread, NULL, sortRunWorker, buffer) != 0)
+            {
+                result = -1;
+                break;
+            }
+            buffer->busy = 1;
+            current = (current + 1) % threads;
+            buffer = &buffers[current];
+            if (sortBufferWait(buffer) != 0)
+            {
+                result = -1;
+                break;
+            }
+        }
+        if (!more)
+        {
+            break;
+        }
+    
+        unsigned char *record = buffer->data + buffer->used;
+        memcpy(record, &packed, 8);
+        record[8] = size - 9;
+        memcpy(record + 9, name, size - 9);
+        buffer->records[buffer->count++] = record;
+        buffer->used += size;
+    }
+    fclose(file);
+    for (int i = 0; i < threads; i++)
+    {
+        if (sortBufferWait(&buffers[i]) != 0)
+        {
+            result = -1;
+        }
+        free(buffers[i].data);
+        free(buffers[i].records);
+    }
+    
+    // Merge passes until one merge can produce the output
+    while (result == 0 && run_count > SORT_MAX_FANIN)
+    {
+        char **merged_names = NULL;
+        int merged_count = 0;
+        for (int first = 0; result == 0 && first < run_count; first += SORT_MAX_FANIN)
+        {
+            int count = run_count - first < SORT_MAX_FANIN ? run_count - first : SORT_MAX_FANIN;
+            char merged_name[FILENAME_SIZE];
+            snprintf(merged_name, sizeof(merged_name), "%s.sort.%d", output, next_run++);
+            FILE *merged = fopen(merged_name, "wb");
+            if (merged == NULL || sortAddRun(&merged_names, &merged_count, merged_name) != 0)
+            {
+                result = -1;
+            }
+            else if (sortMerge(run_names + first, count, field, merged, 0) != 0)
+            {
+                result = -1;
+            }
+            if (merged != NULL && fclose(merged) != 0)
+            {
+                result = -1;
+            }
+        }
+        for (int i = 0; i < run_count; i++)
+        {
+            free(run_names[i]);
+        }
+        free(run_names);
+        run_names = merged_names;
+        run_count = merged_count;
+    }
+    
+    struct atomic_file replace;
+    if (result == 0 && atomicOpen(&replace, output, "w") != NULL)
+    {
+        fprintf(replace.file, "NAME                    NUMBER\n");
+        if (sortMerge(run_names, run_count, field, replace.file, 1) == 0)
+        {
+            result = atomicCommit(&replace);
+        }
+        else
+        {
+            atomicAbort(&replace);
+            result = -1;
+        }
+    }
+    else
+    {
+        result = -1;
+    }
+    
+    for (int i = 0; i < run_count; i++)
+    {
+        unlink(run_names[i]);
+        free(run_names[i]);
+    }
+    free(run_names);
+    *runs = next_run;
+    return result;
+}
+
+// Function to sort a directory file by name or number into another file
+int sortCommand(const char *input, const char *output, const char *field_name, size_t memory)
+{
+    int field = strcmp(field_name, "number") == 0 ? LOOKUP_BY_NUMBER : LOOKUP_BY_NAME;
+    int runs;
+    
+    if (sortFile(input, output, field, memory, &runs) != 0)
+    {
+        printf("Unable to sort the directory.\n");
+        return 1;
+    }
+    printf("Sorted %s by %s into %s using %d runs.\n", input, field == LOOKUP_BY_NUMBER ? "number" : "name",
+           output, runs);
+    return 0;
+}
+
+// Merging directory files. Each input is sorted by name first unless it
+// already is, then one loser tree merges them all in a single streaming
+// pass. Entries are keyed by name. When a name appears in more than one
+// input, the rule picks whose entries survive: the input changed most
+// recently, the leftmost input, or all of them. Identical entries are
+// written once.
+
+// Function to check whether a directory file is sorted by name, then
+// number; returns 1 if so, 0 if not and -1 if it cannot be read
+int directoryIsSorted(const char *filename)
+{
+    struct sort_cursor cursor;
+    struct sort_cursor previous;
+    
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.text = 1;
+    cursor.file = fopen(filename, "r");
+    if (cursor.file == NULL)
+    {
+        return -1;
+    }
+    setvbuf(cursor.file, NULL, _IOFBF, SORT_READ_BUFFER);
+    
+    int sorted = 1;
+    sortCursorNext(&cursor);
+    while (sorted && !cursor.done)
+    {
+        previous = cursor;
+        sortCursorNext(&cursor);
+        sorted = cursor.done || sortCompare(LOOKUP_BY_NAME, previous.name, previous.name_length, previous.number,
+                                            cursor.name, cursor.name_length, cursor.number) <= 0;
+    }
+    fclose(cursor.file);
+    return sorted;
+}
+
+// Function to merge directory files into one, resolving names found in
+// several inputs with a rule
+int mergeCommand(const char *output, const char *rule_name, char **inputs, int count)
+{
+    int rule = strcmp(rule_name, "newest") == 0 ? MERGE_NEWEST : strcmp(rule_name, "left") == 0 ? MERGE_LEFT :
+               strcmp(rule_name, "both") == 0 ? MERGE_BOTH : -1;
+    struct loser_tree loser;
+    struct atomic_file replace;
+    int result = 0;
+    int sorted_inputs = 0;
+    
+    if (rule < 0)
+    {
+        printf("Unknown merge rule: %s\n", rule_name);
+        return 1;
+    }
+    if (count > SORT_MAX_FANIN || strlen(output) + 32 > FILENAME_SIZE)
+    {
+        printf("Too many files to merge.\n");
+        return 1;
+    }
+    
+    char **names = calloc(count, sizeof(char *));
+    int *temporary = calloc(count, sizeof(int));
+    time_t *changed = calloc(count, sizeof(time_t));
+    loser.k = count;
+    loser.field = LOOKUP_BY_NAME;
+    loser.tree = malloc((count + 1) * sizeof(int));
+    loser.cursors = calloc(count + 1, sizeof(struct sort_cursor));
+    if (names == NULL || temporary == NULL || changed == NULL || loser.tree == NULL || loser.cursors == NULL)
+    {
+        result = -1;
+    }
+    
+    // Sort the inputs that need it into temporary files next to the output
+    for (int i = 0; result == 0 && i < count; i++)
+    {
+        struct stat info;
+        int sorted = directoryIsSorted(inputs[i]);
+        if (sorted < 0 || stat(inputs[i], &info) != 0)
+        {
+            printf("Unable to open %s.\n", inputs[i]);
+            result = -1;
+            break;
+        }
+        changed[i] = info.st_mtime;
+    
+        char sorted_name[FILENAME_SIZE];
+        int runs;
+        snprintf(sorted_name, sizeof(sorted_name), "%s.merge.%d", output, i);
+        if (!sorted && sortFile(inputs[i], sorted_name, LOOKUP_BY_NAME, SORT_DEFAULT_MEMORY, &runs) != 0)
+        {
+            result = -1;
+            break;
+        }
+        temporary[i] = !sorted;
+        sorted_inputs += !sorted;
+        names[i] = strdup(sorted ? inputs[i] : sorted_name);
+        if (names[i] == NULL)
+        {
+            result = -1;
+        }
+    }
+    
+    for (int i = 0; result == 0 && i < count; i++)
+    {
+        loser.cursors[i].text = 1;
+        loser.cursors[i].file = fopen(names[i], "r");
+        if (loser.cursors[i].file == NULL)
+        {
+            result = -1;
+            break;
+        }
+        setvbuf(loser.cursors[i].file, NULL, _IOFBF, SORT_READ_BUFFER);
+        sortCursorNext(&loser.cursors[i]);
+    }
+    if (result == 0 && atomicOpen(&replace, output, "w") == NULL)
+    {
+        result = -1;
+    }
+    
+    unsigned long long written = 0;
+    unsigned long long conflicts = 0;
+    unsigned long long dropped = 0;
+    if (result == 0)
+    {
+        for (int i = 0; i <= count; i++)
+        {
+            loser.tree[i] = count;
+        }
+        for (int i = count - 1; i >= 0; i--)
+        {
+            loserAdjust(&loser, i);
+        }
+    
+        fprintf(replace.file, "NAME                    NUMBER\n");
+        char group[MAX_NAME_LENGTH];
+        int group_length = -1;
+        int keep = -1;
+        int kept_any = 0;
+        uint64_t kept_number = 0;
+        while (!loser.cursors[loser.tree[0]].done)
+        {
+            int source = loser.tree[0];
+            struct sort_cursor *winner = &loser.cursors[source];
+    
+            // At the first entry of a name, every input holding that name
+            // has it as its current entry, so the rule can pick one now
+            if (winner->name_length != group_length || memcmp(winner->name, group, group_length) != 0)
+            {
+                int holders = 0;
+                group_length = winner->name_length;
+                memcpy(group, winner->name, group_length);
+                keep = -1;
+                kept_any = 0;
+                for (int i = 0; i < count; i++)
+                {
+                    const struct sort_cursor *cursor = &loser.cursors[i];
+                    if (cursor->done || cursor->name_length != group_length ||
+                        memcmp(cursor->name, group, group_length) != 0)
+                    {
+                        continue;
+                    }
+                    holders++;
+                    if (keep < 0 || (rule == MERGE_NEWEST && changed[i] >= changed[keep]))
+                    {
+                        keep = i;
+                    }
+                }
+                conflicts += holders > 1;
+            }
+    
+            if ((rule == MERGE_BOTH || source == keep) && !(kept_any && kept_number == winner->number))
+            {
+                exportLine(replace.file, winner->name, winner->name_length, winner->number);
+                kept_any = 1;
+                kept_number = winner->number;
+                written++;
+            }
+            else
+            {
+                dropped++;
+            }
+            sortCursorNext(winner);
+            loserAdjust(&loser, source);
+        }
+    
+        if (ferror(replace.file))
+        {
+            atomicAbort(&replace);
+            result = -1;
+        }
+        else
+        {
+            result = atomicCommit(&replace);
+        }
+    }
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (loser.cursors != NULL && loser.cursors[i].file != NULL)
+        {
+            fclose(loser.cursors[i].file);
+        }
+        if (names != NULL && names[i] != NULL && temporary[i])
+        {
+            unlink(names[i]);
+        }
+        if (names != NULL)
+        {
+            free(names[i]);
+        }
+    }
+    free(names);
+    free(temporary);
+    free(changed);
+    free(loser.tree);
+    free(loser.cursors);
+    if (result != 0)
+    {
+        printf("Unable to merge the directories.\n");
+        return 1;
+    }
+    printf("Merged %d files into %s (%d sorted first): %llu entries written, %llu names in conflict, %llu entries dropped.\n",
+           count, output, sorted_inputs, written, conflicts, dropped);
+    return 0;
+}
+
+// Directory diff. Entries are keyed by name and compared per name, number
+// by number; a removed number followed by an added one (or the other way
+// round) under the same name is reported as a change. Two inputs already
+// sorted by name are compared in one streaming pass. Otherwise both are
+// split into DIFF_PARTITIONS files by a hash of the name, and threads sort
+// and compare matching partitions in memory, each into its own output
+// that is appended to the report in partition order.
+struct diff_counts
+{
+    unsigned long long added;
+    unsigned long long removed;
+    unsigned long long changed;
+};
+
+struct diff_partitioner
+{
+    const char *input;
+    const char *prefix;
+    const char *side;
+    int result;
+    pthread_t thread;
+};
+
+struct diff_job
+{
+    const char *prefix;
+    int next_partition;
+    int result;
+    struct diff_counts counts[DIFF_PARTITIONS];
+};
+
+// Function to write one line of a diff report
+void diffWrite(FILE *out, struct diff_counts *counts, int kind, const char *name, int len, uint64_t number,
+               uint64_t new_number)
+{
+    char text[NUMBER_TEXT_SIZE];
+    char new_text[NUMBER_TEXT_SIZE];
+    
+    formatNumber(number, text);
+    if (kind == DIFF_CHANGED)
+    {
+        formatNumber(new_number, new_text);
+        fprintf(out, "changed %.*s %s -> %s\n", len, name, text, new_text);
+        counts->changed++;
+    }
+    else
+    {
+        fprintf(out, "%s %.*s %s\n", kind == DIFF_ADDED ? "added" : "removed", len, name, text);
+        if (kind == DIFF_ADDED)
+        {
+            counts->added++;
+        }
+        else
+        {
+            counts->removed++;
+        }
+    }
+}
+
+// Function to tell whether a cursor's current entry has a given name
+int cursorHasName(const struct sort_cursor *cursor, const char *name, int len)
+{
+    return !cursor->done && cursor->name_length == len && memcmp(cursor->name, name, len) == 0;
+}
+
+// Function to compare two cursors sorted by name, then number
+void diffStreams(struct sort_cursor *old, struct sort_cursor *new, FILE *out, struct diff_counts *counts)
+{
+    char group[MAX_NAME_LENGTH];
+    
+    while (!old->done || !new->done)
+    {
+        int order = old->done ? 1 : new->done ? -1 : sortCompare(LOOKUP_BY_NAME, old->name, old->name_length, 0,
+                                                                 new->name, new->name_length, 0);
+        const struct sort_cursor *first = order <= 0 ? old : new;
+        int group_length = first->name_length;
+        int pending = DIFF_NONE;
+        uint64_t pending_number = 0;
+        memcpy(group, first->name, group_length);
+    
+        // Walk the name's numbers on both sides; at most one unmatched
+        // number waits for a partner from the other side
+        while (1)
+        {
+            int in_old = cursorHasName(old, group, group_length);
+            int in_new = cursorHasName(new, group, group_length);
+            int kind;
+            uint64_t number;
+    
+            if (!in_old && !in_new)
+            {
+                break;
+            }
+            if (in_old && in_new && old->number == new->number)
+            {
+                sortCursorNext(old);
+                sortCursorNext(new);
+                continue;
+            }
+            if (in_old && (!in_new || old->number < new->number))
+            {
+                kind = DIFF_REMOVED;
+                number = old->number;
+                sortCursorNext(old);
+            }
+            else
+            {
+                kind = DIFF_ADDED;
+                number = new->number;
+                sortCursorNext(new);
+            }
+    
+            if (pending != DIFF_NONE && pending != kind)
+            {
+                diffWrite(out, counts, DIFF_CHANGED, group, group_length, kind == DIFF_REMOVED ? number : pending_number,
+                          kind == DIFF_REMOVED ? pending_number : number);
+                pending = DIFF_NONE;
+                continue;
+            }
+            if (pending != DIFF_NONE)
+            {
+                diffWrite(out, counts, pending, group, group_length, pending_number, 0);
+            }
+            pending = kind;
+            pending_number = number;
+        }
+        if (pending != DIFF_NONE)
+        {
+            diffWrite(out, counts, pending, group, group_length, pending_number, 0);
+        }
+    }
+}
+
+// Function run by a thread that splits one input into partition files
+void *diffPartitionWorker(void *argument)
+{
+    struct diff_partitioner *partitioner = argument;
+    FILE *parts[DIFF_PARTITIONS] = {NULL};
+    struct sort_cursor cursor;
+    char filename[FILENAME_SIZE];
+    
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.text = 1;
+    cursor.file = fopen(partitioner->input, "r");
+    partitioner->result = cursor.file == NULL ? -1 : 0;
+    for (int p = 0; partitioner->result == 0 && p < DIFF_PARTITIONS; p++)
+    {
+        snprintf(filename, sizeof(filename), "%s.diff.%s.%d", partitioner->prefix, partitioner->side, p);
+        parts[p] = fopen(filename, "wb");
+        if (parts[p] == NULL)
+        {
+            partitioner->result = -1;
+        }
+    }
+    
+    if (partitioner->result == 0)
+    {
+        setvbuf(cursor.file, NULL, _IOFBF, SORT_READ_BUFFER);
+        for (sortCursorNext(&cursor); !cursor.done; sortCursorNext(&cursor))
+        {
+            unsigned char header[9];
+            FILE *part = parts[hashName(cursor.name, cursor.name_length) % DIFF_PARTITIONS];
+            memcpy(header, &cursor.number, 8);
+            header[8] = cursor.name_length;
+            fwrite(header, 1, 9, part);
+            fwrite(cursor.name, 1, cursor.name_length, part);
+        }
+    }
+    
+    if (cursor.file != NULL)
+    {
+        fclose(cursor.file);
+    }
+    for (int p = 0; p < DIFF_PARTITIONS; p++)
+    {
+        if (parts[p] != NULL && (ferror(parts[p]) || fclose(parts[p]) != 0))
+        {
+            partitioner->result = -1;
+        }
+    }
+    return NULL;
+}
+
+// Function to read a partition file into memory and sort its records by
+// name, then number; the cursor reads the result
+int diffLoadPartition(const char *filename, struct sort_cursor *cursor, unsigned char **data)
+{
+    struct stat info;
+    FILE *file = fopen(filename, "rb");
+    
+    memset(cursor, 0, sizeof(*cursor));
+    *data = NULL;
+    if (file == NULL || fstat(fileno(file), &info) != 0)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return -1;
+    }
+    
+    size_t size = info.st_size;
+    *data = malloc(size + 1);
+    cursor->records = malloc((size / 10 + 1) * sizeof(unsigned char *));
+    if (*data == NULL || cursor->records == NULL || fread(*data, 1, size, file) != size)
+    {
+        fclose(file);
+        free(*data);
+        free(cursor->records);
+        cursor->records = NULL;
+        *data = NULL;
+        return -1;
+    }
+    fclose(file);
+    
+    // Every record is at least 10 bytes: 8 for the number, 1 for the
+    // length and a name of at least one byte
+    for (size_t offset = 0; offset + 9 <= size && offset + 9 + (*data)[offset + 8] <= size;
+         offset += 9 + (*data)[offset + 8])
+    {
+        cursor->records[cursor->count++] = *data + offset;
+    }
+    qsort(cursor->records, cursor->count, sizeof(unsigned char *), compareRecordsByName);
+    sortCursorNext(cursor);
+    return 0;
+}
+
+// Function run by a diff thread: compare partitions until none are left
+void *diffCompareWorker(void *argument)
+{
+    struct diff_job *job = argument;
+    char filename[FILENAME_SIZE];
+    
+    while (1)
+    {
+        int p = __atomic_fetch_add(&job->next_partition, 1, __ATOMIC_RELAXED);
+        if (p >= DIFF_PARTITIONS)
+        {
+            break;
+        }
+    
+        struct sort_cursor old;
+        struct sort_cursor new;
+        unsigned char *old_data;
+        unsigned char *new_data;
+        int result = 0;
+        snprintf(filename, sizeof(filename), "%s.diff.old.%d", job->prefix, p);
+        result |= diffLoadPartition(filename, &old, &old_data);
+        unlink(filename);
+        snprintf(filename, sizeof(filename), "%s.diff.new.%d", job->prefix, p);
+        result |= diffLoadPartition(filename, &new, &new_data);
+        unlink(filename);
+    
+        snprintf(filename, sizeof(filename), "%s.diff.out.%d", job->prefix, p);
+        FILE *out = result == 0 ? fopen(filename, "w") : NULL;
+        if (out != NULL)
+        {
+            diffStreams(&old, &new, out, &job->counts[p]);
+            result = ferror(out) ? -1 : 0;
+            if (fclose(out) != 0)
+            {
+                result = -1;
+            }
+        }
+        else
+        {
+            result = -1;
+        }
+        if (result != 0)
+        {
+            __atomic_store_n(&job->result, -1, __ATOMIC_RELAXED);
+        }
+        free(old.records);
+        free(new.records);
+        free(old_data);
+        free(new_data);
+    }
+    return NULL;
+}
+
+// Function to compare unsorted inputs through hash partitions
+int diffPartitioned(const char *old_name, const char *new_name, const char *prefix, FILE *out,
+                    struct diff_counts *counts)
+{
+    struct diff_partitioner partitioners[2] = {{old_name, prefix, "old", 0, 0}, {new_name, prefix, "new", 0, 0}};
+    struct diff_job job;
+    pthread_t threads[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS] = {0};
+    char filename[FILENAME_SIZE];
+    char buffer[SORT_READ_BUFFER];
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    // Split both inputs at the same time
+    int split = pthread_create(&partitioners[1].thread, NULL, diffPartitionWorker, &partitioners[1]) == 0;
+    diffPartitionWorker(&partitioners[0]);
+    if (split)
+    {
+        pthread_join(partitioners[1].thread, NULL);
+    }
+    else
+    {
+        diffPartitionWorker(&partitioners[1]);
+    }
+    
+    memset(&job, 0, sizeof(job));
+    job.prefix = prefix;
+    job.result = partitioners[0].result | partitioners[1].result;
+    if (job.result == 0)
+    {
+        thread_count = thread_count < 1 ? 1 : thread_count > SORT_MAX_THREADS ? SORT_MAX_THREADS : thread_count;
+        for (int t = 1; t < thread_count; t++)
+        {
+            started[t] = pthread_create(&threads[t], NULL, diffCompareWorker, &job) == 0;
+        }
+        diffCompareWorker(&job);
+        for (int t = 1; t < thread_count; t++)
+        {
+            if (started[t])
+            {
+                pthread_join(threads[t], NULL);
+            }
+        }
+    }
+    
+    // Append the partition reports in order and clean up
+    for (int p = 0; p < DIFF_PARTITIONS; p++)
+    {
+        const char *sides[] = {"old", "new", "out"};
+        for (int side = 0; side < 3; side++)
+        {
+            snprintf(filename, sizeof(filename), "%s.diff.%s.%d", prefix, sides[side], p);
+            FILE *part = side == 2 && job.result == 0 ? fopen(filename, "r") : NULL;
+            size_t size;
+            while (part != NULL && (size = fread(buffer, 1, sizeof(buffer), part)) > 0)
+            {
+                fwrite(buffer, 1, size, out);
+            }
+            if (part != NULL)
+            {
+                fclose(part);
+            }
+            unlink(filename);
+        }
+        counts->added += job.counts[p].added;
+        counts->removed += job.counts[p].removed;
+        counts->changed += job.counts[p].changed;
+    }
+    return job.result;
+}
+
+// Function to report the differences between two directory files, on the
+// screen or in a file
+int diffCommand(const char *old_name, const char *new_name, const char *output)
+{
+    struct diff_counts counts = {0, 0, 0};
+    struct atomic_file replace;
+    FILE *out = stdout;
+    const char *prefix = output != NULL ? output : new_name;
+    int result;
+    
+    int old_sorted = directoryIsSorted(old_name);
+    int new_sorted = directoryIsSorted(new_name);
+    if (old_sorted < 0 || new_sorted < 0)
+    {
+        printf("Unable to open the file.");
+        return 1;
+    }
+    if (strlen(prefix) + 32 > FILENAME_SIZE)
+    {
+        printf("The file name is too long.\n");
+        return 1;
+    }
+    if (output != NULL)
+    {
+        if (atomicOpen(&replace, output, "w") == NULL)
+        {
+            printf("Unable to open the file.");
+            return 1;
+        }
+        out = replace.file;
+    }
+    
+    if (old_sorted && new_sorted)
+    {
+        struct sort_cursor old;
+        struct sort_cursor new;
+        memset(&old, 0, sizeof(old));
+        memset(&new, 0, sizeof(new));
+        old.text = new.text = 1;
+        old.file = fopen(old_name, "r");
+        new.file = fopen(new_name, "r");
+        result = old.file != NULL && new.file != NULL ? 0 : -1;
+        if (result == 0)
+        {
+            setvbuf(old.file, NULL, _IOFBF, SORT_READ_BUFFER);
+            setvbuf(new.file, NULL, _IOFBF, SORT_READ_BUFFER);
+            sortCursorNext(&old);
+            sortCursorNext(&new);
+            diffStreams(&old, &new, out, &counts);
+        }
+        if (old.file != NULL)
+        {
+            fclose(old.file);
+        }
+        if (new.file != NULL)
+        {
+            fclose(new.file);
+        }
+    }
+    else
+    {
+        result = diffPartitioned(old_name, new_name, prefix, out, &counts);
+    }
+    
+    if (output != NULL)
+    {
+        if (result == 0 && !ferror(out))
+        {
+            result = atomicCommit(&replace);
+        }
+        else
+        {
+            atomicAbort(&replace);
+            result = -1;
+        }
+    }
+    if (result != 0)
+    {
+        printf("Unable to compare the directories.\n");
+        return 1;
+    }
+    printf("%llu added, %llu removed, %llu changed.\n", counts.added, counts.removed, counts.changed);
+    return 0;
+}
+
+// Duplicate detection. Names are normalized to lower-case letters and
+// digits, so spacing, case and punctuation do not count. Rows are blocked
+// twice, by number and by a phonetic key of the normalized name, with a
+// radix sort on the block key followed by the normalized name. Only rows
+// in the same block are compared: every pair in a small block, and a
+// sliding window of neighbours in a large one, which keeps the work near
+// linear. Threads score the blocks of their slice, pairs scoring at least
+// DEDUP_THRESHOLD are joined with union-find, and each cluster is either
+// reported or merged into its first entry.
+struct dedup_job
+{
+    const struct directory_table *table;
+    const struct radix_item *items;
+    int begin;
+    int end;
+    unsigned long long compared;
+    int *pairs;
+    int pair_count;
+    int pair_capacity;
+    int result;
+};
+
+// Function to normalize a name to lower-case letters and digits; returns
+// the new length
+int normalizeName(const char *name, int len, char *normalized)
 {
-    char c = ' ';
+    int out = 0;
     
     for (int i = 0; i < len; i++)
     {
-        fprintf(file, "%c", c);
+        char c = name[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            normalized[out++] = c - 'A' + 'a';
+        }
+        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+        {
+            normalized[out++] = c;
+        }
     }
+    return out;
 }
 
-// Function to write a telephone entry to the file
-void write(struct telephone* input, FILE *file)
+// Function to compute a phonetic key of a normalized name: its first
+// character followed by Soundex consonant classes, repeats collapsed
+uint64_t phoneticKey(const char *normalized, int len)
 {
-    int len = strlen(input->name);
-    int sp_len = 20 - len;
+    static const char classes[] = "01230120022455012623010202";
+    char code[MAX_NAME_LENGTH];
+    int size = 0;
+    char last = 0;
     
-    fprintf(file, "%s", input->name);
-    space(sp_len, file);
-    fprintf(file, "%s\n", input->number);
+    for (int i = 0; i < len; i++)
+    {
+        char c = normalized[i];
+        char digit = c >= 'a' && c <= 'z' ? classes[c - 'a'] : c;
+        if (i == 0)
+        {
+            code[size++] = c;
+        }
+        else if (digit != '0' && digit != last)
+        {
+            code[size++] = digit;
+        }
+        // h and w do not separate repeated classes, vowels do
+        if (c != 'h' && c != 'w')
+        {
+            last = digit;
+        }
+    }
+    return hashName(code, size);
 }
 
-// Function to insert a new entry in the telephone directory
-void insertEntry(FILE *file)
+// Function to get the similarity of two normalized names, 1 - edit
+// distance / longer length; returns 0 early once it cannot reach floor
+double nameSimilarity(const char *a, int la, const char *b, int lb, double floor)
 {
-    static int number = 1;
-    printf("Entry number %d: \n",number);
-    
-    fseek(file, 0, SEEK_END);
-    struct telephone newentry;
-    
-    printf("Enter the Name: ");
-    scanf(" %[^\n]s", newentry.name);
+    int row[MAX_NAME_LENGTH + 1];
+    int longer = la > lb ? la : lb;
     
-    printf("Enter the phoneNumber: ");
-    scanf(" %[^\n]s", newentry.number);
+    if (longer == 0)
+    {
+        return 1;
+    }
+    if (1 - (double)abs(la - lb) / longer < floor)
+    {
+        return 0;
+    }
     
-    write(&newentry, file);
-    printf("Entry inserted...\n");
-    number+=1;
+    for (int j = 0; j <= lb; j++)
+    {
+        row[j] = j;
+    }
+    for (int i = 1; i <= la; i++)
+    {
+        int diagonal = row[0];
+        row[0] = i;
+        for (int j = 1; j <= lb; j++)
+        {
+            int above = row[j];
+            int best = diagonal + (a[i - 1] != b[j - 1]);
+            best = above + 1 < best ? above + 1 : best;
+            best = row[j - 1] + 1 < best ? row[j - 1] + 1 : best;
+            row[j] = best;
+            diagonal = above;
+        }
+    }
+    return 1 - (double)row[lb] / longer;
 }
 
-// Function to update an existing entry in the telephone directory
-void updateEntry(FILE *file)
+// Function to score how likely two rows are the same entry, from 0 to 1.
+// Names that are equal once normalized are the same entry whatever the
+// numbers, which is what the phonetic blocks find. Otherwise name
+// similarity and number agreement are averaged: equal numbers count
+// fully, and a number that ends with the other one (a missing prefix)
+// counts 0.8.
+double dedupScore(const struct directory_table *table, int a, int b)
 {
-    if (num > 0)
+    char name_a[MAX_NAME_LENGTH];
+    char name_b[MAX_NAME_LENGTH];
+    uint64_t number_a = tableNumber(table, a);
+    uint64_t number_b = tableNumber(table, b);
+    double number_score = 0;
+    
+    int la = normalizeName(tableNamePointer(table, a), tableNameLength(table, a), name_a);
+    int lb = normalizeName(tableNamePointer(table, b), tableNameLength(table, b), name_b);
+    if (la == lb && memcmp(name_a, name_b, la) == 0)
     {
-        printf("Give the entry number n-%d...\n",num - 1);
+        return 1;
     }
     
-    int entrynumber;
-    printf("Enter the entry number to update: ");
-    scanf("%d", &entrynumber);
-    entrynumber += 1;
-    fflush(stdin);
-    
-    fseek(file, (entrynumber - 1) * sizeof(struct telephone), SEEK_SET);
-    
-    struct telephone existingEntry;
-    fread(&existingEntry, sizeof(struct telephone), 1, file);
+    if (number_a == number_b)
+    {
+        number_score = 1;
+    }
+    else
+    {
+        char text_a[PACKED_MAX_DIGITS + 1];
+        char text_b[PACKED_MAX_DIGITS + 1];
+        unpackNumber(number_a, text_a);
+        unpackNumber(number_b, text_b);
+        int da = strlen(text_a);
+        int db = strlen(text_b);
+        const char *longer = da > db ? text_a : text_b;
+        const char *shorter = da > db ? text_b : text_a;
+        int ds = da > db ? db : da;
+        if (ds >= DEDUP_SUFFIX_DIGITS && strcmp(longer + strlen(longer) - ds, shorter) == 0)
+        {
+            number_score = 0.8;
+        }
+    }
+    if ((1 + number_score) / 2 < DEDUP_THRESHOLD)
+    {
+        return 0;
+    }
     
-    printf("Enter Updated name: ");
-    scanf(" %[^\n]s", existingEntry.name);
+    double floor = 2 * DEDUP_THRESHOLD - number_score;
+    return (nameSimilarity(name_a, la, name_b, lb, floor) + number_score) / 2;
+}
 
-    printf("Enter updated phoneNumber: ");
-    scanf(" %[^\n]s", existingEntry.number);
+// Function to record a matching pair of rows
+int dedupAddPair(struct dedup_job *job, int a, int b)
+{
+    if (job->pair_count + 2 > job->pair_capacity)
+    {
+        int capacity = job->pair_capacity ? job->pair_capacity * 2 : 1024;
+        int *pairs = realloc(job->pairs, capacity * sizeof(int));
+        if (pairs == NULL)
+        {
+            return -1;
+        }
+        job->pairs = pairs;
+        job->pair_capacity = capacity;
+    }
+    job->pairs[job->pair_count++] = a;
+    job->pairs[job->pair_count++] = b;
+    return 0;
+}
+
+// Function run by a dedup thread: score the candidate pairs of the blocks
+// in its slice of the sorted items
+void *dedupScoreWorker(void *argument)
+{
+    struct dedup_job *job = argument;
+    const struct radix_item *items = job->items;
     
-    fseek(file, (entrynumber - 1) * sizeof(struct telephone), SEEK_SET);
+    for (int first = job->begin; job->result == 0 && first < job->end;)
+    {
+        int last = first + 1;
+        while (last < job->end && memcmp(items[last].key, items[first].key, 8) == 0)
+        {
+            last++;
+        }
     
-    write(&existingEntry, file);
-    printf("Updated successfully...\n");
+        int window = last - first <= DEDUP_MAX_BLOCK ? last - first : DEDUP_WINDOW + 1;
+        for (int i = first; i < last; i++)
+        {
+            for (int j = i + 1; j < last && j < i + window; j++)
+            {
+                job->compared++;
+                if (dedupScore(job->table, items[i].row, items[j].row) >= DEDUP_THRESHOLD &&
+                    dedupAddPair(job, items[i].row, items[j].row) != 0)
+                {
+                    job->result = -1;
+                }
+            }
+        }
+        first = last;
+    }
+    return NULL;
 }
 
-// Function to remove a specific line from the file
-void RemoveLineFromFile(FILE *file, int line_number)
+// Function to find the cluster of a row, halving the path as it goes
+int dedupFind(int *parent, int row)
 {
-    FILE *temp_file = fopen("temp.txt", "w");
-    if (temp_file == NULL)
+    while (parent[row] != row)
     {
-        printf("Unable to open the temporary file.");
-        return;
+        parent[row] = parent[parent[row]];
+        row = parent[row];
     }
+    return row;
+}
+
+// Function to block the rows by one key, score the candidates in threads
+// and join the matches; by_number picks the number or the phonetic key
+int dedupPass(const struct directory_table *table, int by_number, int *parent, unsigned long long *compared)
+{
+    struct dedup_job jobs[SORT_MAX_THREADS];
+    pthread_t threads[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS] = {0};
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = table->count;
+    int result = 0;
     
-    char buffer[MAX_LINE];
-    int current_line = 1;
+    struct radix_item *items = malloc((count + 1) * sizeof(struct radix_item));
+    struct radix_item *scratch = malloc((count + 1) * sizeof(struct radix_item));
+    if (items == NULL || scratch == NULL)
+    {
+        free(items);
+        free(scratch);
+        return -1;
+    }
     
-    while (fgets(buffer, MAX_LINE, file) != NULL)
+    // Block key first, then the normalized name so that similar names in
+    // a large block end up next to each other
+    for (int row = 0; row < count; row++)
     {
-        if (current_line != line_number)
+        char normalized[MAX_NAME_LENGTH];
+        int len = normalizeName(tableNamePointer(table, row), tableNameLength(table, row), normalized);
+        uint64_t block = by_number ? tableNumber(table, row) : phoneticKey(normalized, len);
+        for (int i = 0; i < 8; i++)
         {
-            fputs(buffer, temp_file);
+            items[row].key[i] = block >> (56 - 8 * i);
         }
-        
-        current_line++;
+        memset(items[row].key + 8, 0, RADIX_KEY_SIZE - 8);
+        memcpy(items[row].key + 8, normalized, len < RADIX_KEY_SIZE - 8 ? len : RADIX_KEY_SIZE - 8);
+        items[row].row = row;
     }
+    struct radix_item *sorted = radixSort(items, scratch, count, RADIX_KEY_SIZE);
     
-    fclose(file);
-    fclose(temp_file);
+    // Slices start on block boundaries
+    thread_count = thread_count < 1 ? 1 : thread_count > SORT_MAX_THREADS ? SORT_MAX_THREADS : thread_count;
+    memset(jobs, 0, sizeof(jobs));
+    for (int t = 0; t < thread_count; t++)
+    {
+        int begin = (int)((long long)count * t / thread_count);
+        while (begin > 0 && begin < count && memcmp(sorted[begin - 1].key, sorted[begin].key, 8) == 0)
+        {
+            begin++;
+        }
+        jobs[t].table = table;
+        jobs[t].items = sorted;
+        jobs[t].begin = t == 0 ? 0 : begin > jobs[t - 1].begin ? begin : jobs[t - 1].begin;
+        if (t > 0)
+        {
+            jobs[t - 1].end = jobs[t].begin;
+        }
+    }
+    jobs[thread_count - 1].end = count;
     
-    remove("telephone_directory.txt");
-    rename("temp.txt", "telephone_directory.txt");
+    for (int t = 1; t < thread_count; t++)
+    {
+        started[t] = pthread_create(&threads[t], NULL, dedupScoreWorker, &jobs[t]) == 0;
+        if (!started[t])
+        {
+            dedupScoreWorker(&jobs[t]);
+        }
+    }
+    dedupScoreWorker(&jobs[0]);
+    for (int t = 0; t < thread_count; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(threads[t], NULL);
+        }
     
-    printf("Entry deleted successfully.\n");
+        // The oldest row of a cluster becomes its root
+        for (int i = 0; i < jobs[t].pair_count; i += 2)
+        {
+            int a = dedupFind(parent, jobs[t].pairs[i]);
+            int b = dedupFind(parent, jobs[t].pairs[i + 1]);
+            if (a != b)
+            {
+                parent[a > b ? a : b] = a > b ? b : a;
+            }
+        }
+        *compared += jobs[t].compared;
+        result |= jobs[t].result;
+        free(jobs[t].pairs);
+    }
+    free(items);
+    free(scratch);
+    return result;
 }
 
-// Function to delete an entry from the telephone directory
-void deleteEntry()
+// Function to find duplicate entries of a directory file and write either
+// a report of the clusters or, when merging, the file without duplicates
+int dedupCommand(const char *input, const char *output, int merge)
 {
-    int entrynumber;
+    struct directory_table table = {0};
+    struct atomic_file replace;
+    unsigned long long compared = 0;
+    FILE *file = fopen(input, "r");
     
-    if (num > 0)
+    if (file == NULL)
     {
-        printf("Give the entry number n-%d...\n",num);
+        printf("Unable to open the file.");
+        return 1;
     }
+    int loaded = tableLoad(&table, file);
+    fclose(file);
     
-    printf("Enter entry number to delete: ");
-    scanf("%d", &entrynumber);
-    entrynumber += 1;
-    fflush(stdin);
+    int *parent = malloc((table.count + 1) * sizeof(int));
+    int *next = malloc((table.count + 1) * sizeof(int));
+    int *head = malloc((table.count + 1) * sizeof(int));
+    int result = loaded < 0 || parent == NULL || next == NULL || head == NULL ? -1 : 0;
+    for (int row = 0; result == 0 && row < table.count; row++)
+    {
+        parent[row] = row;
+    }
+    if (result == 0)
+    {
+        result = dedupPass(&table, 1, parent, &compared);
+    }
+    if (result == 0)
+    {
+        result = dedupPass(&table, 0, parent, &compared);
+    }
+    if (result == 0 && atomicOpen(&replace, output, "w") == NULL)
+    {
+        result = -1;
+    }
     
-    FILE *file = fopen("telephone_directory.txt", "r");
-    if (file == NULL)
+    int clusters = 0;
+    int duplicates = 0;
+    if (result == 0)
     {
-        printf("Unable to open the file.");
-        return;
+        // Chain the members of each cluster in row order
+        for (int row = 0; row < table.count; row++)
+        {
+            head[row] = -1;
+        }
+        for (int row = table.count - 1; row >= 0; row--)
+        {
+            int root = dedupFind(parent, row);
+            next[row] = row == root ? -1 : head[root];
+            if (row != root)
+            {
+                head[root] = row;
+                duplicates++;
+            }
+        }
+    
+        if (merge)
+        {
+            fprintf(replace.file, "NAME                    NUMBER\n");
+        }
+        for (int row = 0; row < table.count; row++)
+        {
+            if (parent[row] != row)
+            {
+                continue;
+            }
+            if (merge)
+            {
+                exportLine(replace.file, tableNamePointer(&table, row), tableNameLength(&table, row), tableNumber(&table, row));
+                continue;
+            }
+            if (head[row] < 0)
+            {
+                continue;
+            }
+            int size = 1;
+            for (int member = head[row]; member >= 0; member = next[member])
+            {
+                size++;
+            }
+            fprintf(replace.file, "Cluster %d (%d entries):\n", ++clusters, size);
+            for (int member = row; member >= 0; member = member == row ? head[row] : next[member])
+            {
+                fprintf(replace.file, "    ");
+                exportLine(replace.file, tableNamePointer(&table, member), tableNameLength(&table, member),
+                           tableNumber(&table, member));
+            }
+        }
+        result = ferror(replace.file) ? -1 : 0;
+        if (result == 0)
+        {
+            result = atomicCommit(&replace);
+        }
+        else
+        {
+            atomicAbort(&replace);
+        }
     }
     
-    RemoveLineFromFile(file, entrynumber);
+    free(parent);
+    free(next);
+    free(head);
+    tableFree(&table);
+    if (result != 0)
+    {
+        printf("Unable to find the duplicates.\n");
+        return 1;
+    }
+    if (merge)
+    {
+        printf("Compared %llu candidate pairs; merged %d duplicates, %d entries written to %s.\n", compared, duplicates,
+               loaded - duplicates, output);
+    }
+    else
+    {
+        printf("Compared %llu candidate pairs; found %d clusters with %d duplicates, listed in %s.\n", compared,
+               clusters, duplicates, output);
+    }
+    return 0;
+}
+
+// Function to look up a name or number in a compiled snapshot
+int lookupCommand(const char *filename, const char *field, const char *value)
+{
+    struct snapshot snap;
+    int found;
     
-    num++;
+    if (openSnapshot(filename, &snap) != 0)
+    {
+        printf("Unable to open the snapshot.\n");
+        return 1;
+    }
+    
+    if (strcmp(field, "number") == 0)
+    {
+        uint64_t packed;
+        found = normalizeNumber(value, &packed) == 0 ? snapshotFindNumber(&snap, packed) : 0;
+    }
+    else
+    {
+        found = snapshotFindName(&snap, value);
+    }
+    
+    if (found == 0)
+    {
+        printf("No entry found.\n");
+    }
+    closeSnapshot(&snap);
+    return found ? 0 : 1;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc >= 3 && strcmp(argv[1], "compile") == 0)
+    {
+        return compileCommand(argc >= 4 ? argv[3] : "telephone_directory.txt", argv[2]);
+    }
+    if (argc >= 5 && strcmp(argv[1], "lookup") == 0)
+    {
+        return lookupCommand(argv[2], argv[3], argv[4]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "changes") == 0)
+    {
+        return changesCommand(argc >= 3 ? strtoull(argv[2], NULL, 10) : 0,
+                              argc >= 4 && strcmp(argv[3], "follow") == 0);
+    }
+    if (argc >= 3 && strcmp(argv[1], "follow") == 0)
+    {
+        return followCommand(argv[2], argc >= 4 ? argv[3] : FOLLOWER_FILENAME);
+    }
+    if (argc >= 5 && strcmp(argv[1], "sort") == 0)
+    {
+        return sortCommand(argv[2], argv[3], argv[4], argc >= 6 ? strtoull(argv[5], NULL, 10) : SORT_DEFAULT_MEMORY);
+    }
+    if (argc >= 6 && strcmp(argv[1], "merge") == 0)
+    {
+        return mergeCommand(argv[2], argv[3], argv + 4, argc - 4);
+    }
+    if (argc >= 4 && strcmp(argv[1], "diff") == 0)
+    {
+        return diffCommand(argv[2], argv[3], argc >= 5 ? argv[4] : NULL);
+    }
+    if (argc >= 4 && strcmp(argv[1], "dedup") == 0)
+    {
+        return dedupCommand(argv[2], argv[3], argc >= 5 && strcmp(argv[4], "merge") == 0);
+    }
+    if (argc >= 3 && strcmp(argv[1], "backup") == 0)
+    {
+        return backupCommand(argv[2]);
+    }
+    if (argc >= 4 && strcmp(argv[1], "restore") == 0)
+    {
+        return restoreCommand(argv[2], argv[3], argc >= 5 ? argv[4] : NULL);
+    }
+    int store_shards = 0;
+    if (argc >= 2 && strcmp(argv[1], "lsm") == 0)
+    {
+        store_shards = 1;
+    }
+    else if (argc >= 3 && strcmp(argv[1], "shards") == 0)
+    {
+        store_shards = atoi(argv[2]);
+        argv++;
+        argc--;
+    }
+    else if (argc >= 2)
+    {
+        printf("Usage: %s [lsm [cache-bytes] | shards <count> [cache-bytes] | compile <snapshot> [directory] | lookup <snapshot> name|number <value> | changes [from-sequence [follow]] | follow <change-log> [directory] | sort <directory> <output> name|number [memory-bytes] | merge <output> newest|left|both <directory> <directory>... | diff <old-directory> <new-directory> [output] | dedup <directory> <output> [merge] | backup <dir> | restore <dir> <directory> [sequence|@time-ms]]\n", argv[0]);
+        return 1;
+    }
+    
+    if (store_shards > 0)
+    {
+        // LSM mode: the engines are the store and the text file a view of them
+        blockCacheInit(&block_cache, argc >= 3 ? strtoul(argv[2], NULL, 10) : BLOCK_CACHE_DEFAULT_BYTES);
+        if (storeOpen(store_shards) != 0 || storeLoad(&directory) != 0)
+        {
+            printf("Unable to open the LSM store.\n");
+            return 1;
+        }
+    }
+    
     FILE *file = fopen("telephone_directory.txt", "wb+");
     
     if (file == NULL)
@@ -153,7 +7994,27 @@ int main()
         return 1;
     }
     
-    fprintf(file, "NAME                    NUMBER\n");
+    if (store_shards > 0)
+    {
+        bloomRebuild(&bloom, &directory);
+        tableExport(&directory, file);
+        printf("Loaded %d entries.\n", directory.live_count);
+    }
+    else
+    {
+        fprintf(file, "NAME                    NUMBER\n");
+    }
+    
+    if (changeFeedOpen(&changes) != 0)
+    {
+        printf("Unable to open the change log.\n");
+        return 1;
+    }
+    if (store_shards == 0)
+    {
+        // The text file starts out empty, so followers must start over too
+        changeEmit(&changes, CHANGE_CLEAR, "", 0, "", 0, 0);
+    }
     
     int choice;
     
@@ -163,7 +8024,13 @@ int main()
         printf("1. Insert an entry\n");
         printf("2. Update an entry\n");
         printf("3. Delete an entry\n");
-        printf("4. Exit\n");
+        printf("4. Search by name\n");
+        printf("5. Search by number\n");
+        printf("6. Export the directory\n");
+        printf("7. Show statistics\n");
+        printf("8. Swap the numbers of two entries\n");
+        printf("9. List entries\n");
+        printf("10. Exit\n");
         printf("Enter your choice: ");
         scanf("%d", &choice);
         
@@ -173,7 +8040,9 @@ int main()
                 insertEntry(file);
                 break;
             case 2:
-                updateEntry(file);
+                fclose(file);
+                updateEntry();
+                file = fopen("telephone_directory.txt","r+");
                 break;
             case 3:
                 fclose(file);
@@ -181,7 +8050,46 @@ int main()
                 file = fopen("telephone_directory.txt","r+");
                 break;
             case 4:
+                searchByName();
+                break;
+            case 5:
+                searchByNumber();
+                break;
+            case 6:
+                fflush(file);
+                exportDirectory();
+                break;
+            case 7:
+                showStatistics();
+                break;
+            case 8:
+                fclose(file);
+                swapNumbers();
+                file = fopen("telephone_directory.txt","r+");
+                break;
+            case 9:
+                listEntries();
+                break;
+            case 10:
+                waitForExport();
                 fclose(file);
+                changeFeedClose(&changes);
+                if (shard_count > 0)
+                {
+                    struct atomic_file replace;
+                    storeClose();
+                    blockCacheFree(&block_cache);
+                    ioRingClose();
+                    if (atomicOpen(&replace, "telephone_directory.txt", "w") == NULL)
+                    {
+                        printf("Unable to create the file.");
+                        return 1;
+                    }
+                    tableExport(&directory, replace.file);
+                    atomicCommit(&replace);
+                }
+                tableFree(&directory);
+                free(bloom.blocks);
                 printf("Exiting...\n");
                 return 0;
             default: